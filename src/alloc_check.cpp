@@ -0,0 +1,215 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+// checks that status and current song are parsed without touching the
+// heap once the connection is warmed up, allocations are counted by
+// malloc and friends defined here
+
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <signal.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libmpdclient.h"
+
+using std::string;
+
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+extern "C" void __libc_free(void *);
+
+namespace
+{
+	int failures = 0;
+	bool counting = false;
+	int allocations = 0;
+	
+	const char status[] =
+		"volume: 80\nrepeat: 0\nrandom: 1\nsingle: 0\nconsume: 0\n"
+		"playlist: 1234\nplaylistlength: 5000\nxfade: 2\nstate: play\n"
+		"song: 17\nsongid: 4242\ntime: 63:245\nbitrate: 320\n"
+		"audio: 44100:16:2\nnextsong: 18\nnextsongid: 4243\n";
+	const char song[] =
+		"file: music/Some Artist/Some Album/07 - Some Title.flac\n"
+		"Time: 245\nArtist: Some Artist\nTitle: Some Title\n"
+		"Album: Some Album\nTrack: 7/12\nDate: 1999\nGenre: Rock\n"
+		"Disc: 1/1\nMUSICBRAINZ_TRACKID: 0b3a6f55-0000-4000-8000-123456789abc\n"
+		"Pos: 17\nId: 4242\n";
+		
+	void Check(bool ok, const char *what)
+	{
+		if (!ok)
+		{
+			fprintf(stderr, "FAIL: %s\n", what);
+			failures++;
+		}
+	}
+	
+	void WriteAll(int fd, const string &data)
+	{
+		if (write(fd, data.data(), data.length()) != ssize_t(data.length()))
+			_exit(1);
+	}
+	
+	// answers status alone or along with current song in command list
+	void Serve(int listener)
+	{
+		int fd = accept(listener, 0, 0);
+		if (fd < 0)
+			_exit(1);
+		WriteAll(fd, "OK MPD 0.15.0\n");
+		string line;
+		bool in_list = false;
+		char c;
+		while (read(fd, &c, 1) == 1)
+		{
+			if (c != '\n')
+			{
+				line += c;
+				continue;
+			}
+			if (line == "command_list_ok_begin")
+				in_list = true;
+			else if (line == "command_list_end")
+			{
+				in_list = false;
+				WriteAll(fd, string(status) + "list_OK\n" + song + "list_OK\nOK\n");
+			}
+			else if (line == "status" && !in_list)
+				WriteAll(fd, string(status) + "OK\n");
+			line.clear();
+		}
+		_exit(0);
+	}
+	
+	// reads the response the way MPD::Connection does
+	bool ReadStatusAndSong(mpd_Connection *c, mpd_Status *st, mpd_Song *s)
+	{
+		mpd_sendCommandListOkBegin(c);
+		mpd_sendStatusCommand(c);
+		mpd_sendCurrentSongCommand(c);
+		mpd_sendCommandListEnd(c);
+		counting = true;
+		bool ok = mpd_getStatusInto(c, st) == 0;
+		ok = ok && mpd_nextListOkCommand(c) == 0 && mpd_getSongView(c, s) == 0;
+		mpd_finishCommand(c);
+		counting = false;
+		return ok && c->error == 0;
+	}
+}
+
+extern "C" void *malloc(size_t size)
+{
+	if (counting)
+		allocations++;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+	if (counting)
+		allocations++;
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+	if (counting)
+		allocations++;
+	return __libc_realloc(p, size);
+}
+
+extern "C" void free(void *p)
+{
+	if (counting && p)
+		allocations++;
+	__libc_free(p);
+}
+
+int main()
+{
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+	||  listen(listener, 1) != 0 || getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &addr_len) != 0)
+	{
+		perror("listen");
+		return 1;
+	}
+	int port = ntohs(addr.sin_port);
+	
+	signal(SIGPIPE, SIG_IGN);
+	pid_t server = fork();
+	if (server == 0)
+		Serve(listener);
+	close(listener);
+	
+	mpd_Connection *c = mpd_newConnection("127.0.0.1", port, 10);
+	Check(c->error == 0, "connecting to fake mpd");
+	mpd_Status st;
+	st.error = 0;
+	mpd_Song s;
+	
+	// the first response may still grow buffers of the connection
+	Check(ReadStatusAndSong(c, &st, &s), "reading status and song");
+	allocations = 0;
+	bool same = true;
+	for (int i = 0; i < 1000; i++)
+	{
+		st.volume = 0;
+		s.artist = 0;
+		same = ReadStatusAndSong(c, &st, &s) && same;
+		same = same && st.volume == 80 && st.songid == 4242 && st.elapsedTime == 63 && st.sampleRate == 44100;
+		same = same && s.artist && !strcmp(s.artist, "Some Artist") && s.title && !strcmp(s.title, "Some Title");
+		same = same && s.musicbrainz_trackid && s.time == 245 && s.id == 4242 && s.pos == 17;
+	}
+	Check(same, "status and song are parsed right");
+	Check(allocations == 0, "status and song are parsed without heap allocations");
+	if (allocations)
+		fprintf(stderr, "%d heap calls in 1000 responses\n", allocations);
+		
+	allocations = 0;
+	for (int i = 0; i < 1000; i++)
+	{
+		mpd_sendStatusCommand(c);
+		counting = true;
+		same = mpd_getStatusInto(c, &st) == 0 && same;
+		mpd_finishCommand(c);
+		counting = false;
+	}
+	Check(same && st.playlistLength == 5000, "status alone is parsed right");
+	Check(allocations == 0, "status alone is parsed without heap allocations");
+	
+	mpd_clearStatus(&st);
+	mpd_closeConnection(c);
+	waitpid(server, 0, 0);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,219 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+// checks that responses stream through mpd receive buffer unchanged when
+// lines wrap around its end and make it grow, and that its limit holds
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "libmpdclient.h"
+
+using std::string;
+
+namespace
+{
+	int failures = 0;
+	
+	void Check(bool ok, const char *what)
+	{
+		if (!ok)
+		{
+			fprintf(stderr, "FAIL: %s\n", what);
+			failures++;
+		}
+	}
+	
+	// mostly short lines like real responses, some longer than
+	// initial buffer, so that it has to grow while line is incomplete
+	std::vector<string> MakeCommands()
+	{
+		std::vector<string> commands;
+		srand(1);
+		for (int i = 0; i < 3000; i++)
+		{
+			size_t length = rand() % 50 ? 1 + rand() % 200 : MPD_BUFFER_INITIAL_LENGTH + rand() % 40000;
+			string command(length, 0);
+			for (size_t j = 0; j < length; j++)
+				command[j] = 'a' + rand() % 26;
+			commands.push_back(command);
+		}
+		return commands;
+	}
+	
+	bool WriteAll(int fd, const char *p, size_t left)
+	{
+		while (left > 0)
+		{
+			ssize_t n = write(fd, p, left);
+			if (n <= 0)
+				return false;
+			p += n;
+			left -= n;
+		}
+		return true;
+	}
+	
+	// plays mpd for one connection, response is sent in pieces of random
+	// size, so that lines are split between reads at all kinds of places
+	void Serve(int listener, const string &response)
+	{
+		int fd = accept(listener, 0, 0);
+		if (fd < 0)
+			_exit(1);
+		const char welcome[] = "OK MPD 0.15.0\n";
+		WriteAll(fd, welcome, sizeof(welcome)-1);
+		char c;
+		while (read(fd, &c, 1) == 1 && c != '\n') { }
+		for (size_t pos = 0; pos < response.length(); )
+		{
+			size_t n = std::min(response.length()-pos, size_t(1 + rand() % 5000));
+			if (!WriteAll(fd, response.data()+pos, n))
+				break;
+			pos += n;
+		}
+		close(fd);
+	}
+	
+	// reads response the way the main loop does, without blocking and
+	// checking if it's complete after each read. returns 1 if it is, 0
+	// if reading failed. responseComplete has to remember how far it got.
+	int ReadAvailable(mpd_Connection *c, bool &remembered)
+	{
+		while (c->error == 0)
+		{
+			pollfd pfd = { c->sock, POLLIN, 0 };
+			// socket is readable, so nothing read means buffer is stuck
+			if (poll(&pfd, 1, 10000) != 1 || mpd_recvAvailable(c) <= 0)
+				return 0;
+			if (mpd_responseComplete(c))
+				return 1;
+			remembered = remembered && c->respScanned == c->buflen;
+		}
+		return 0;
+	}
+}
+
+int main()
+{
+	std::vector<string> commands = MakeCommands();
+	string response;
+	for (size_t i = 0; i < commands.size(); i++)
+		response += "command: " + commands[i] + "\n";
+	response += "OK\n";
+	string too_long = "command: " + string(3*MPD_BUFFER_INITIAL_LENGTH, 'x') + "\nOK\n";
+	string short_lines;
+	for (size_t i = 0; i < 2000; i++)
+		short_lines += "command: " + commands[i].substr(0, 20) + "\n";
+	short_lines += "OK\n";
+	
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+	||  listen(listener, 2) != 0 || getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &addr_len) != 0)
+	{
+		perror("listen");
+		return 1;
+	}
+	int port = ntohs(addr.sin_port);
+	
+	signal(SIGPIPE, SIG_IGN);
+	pid_t server = fork();
+	if (server == 0)
+	{
+		Serve(listener, response);
+		Serve(listener, too_long);
+		Serve(listener, short_lines);
+		Serve(listener, too_long);
+		_exit(0);
+	}
+	close(listener);
+	
+	mpd_Connection *c = mpd_newConnection("127.0.0.1", port, 10);
+	Check(c->error == 0, "connecting to fake mpd");
+	mpd_sendCommandsCommand(c);
+	size_t count = 0;
+	bool same = true;
+	while (char *command = mpd_getNextCommand(c))
+	{
+		same = same && count < commands.size() && commands[count] == command;
+		count++;
+		free(command);
+	}
+	mpd_finishCommand(c);
+	Check(c->error == 0, "reading long response");
+	Check(count == commands.size(), "all lines are read");
+	Check(same, "lines are read unchanged");
+	Check(c->bufsize > MPD_BUFFER_INITIAL_LENGTH && c->bufsize <= MPD_BUFFER_MAX_LENGTH, "buffer grows for long lines");
+	mpd_closeConnection(c);
+	
+	c = mpd_newConnection("127.0.0.1", port, 10);
+	Check(c->error == 0, "connecting to fake mpd again");
+	mpd_setBufferLimit(c, 2*MPD_BUFFER_INITIAL_LENGTH);
+	mpd_sendCommandsCommand(c);
+	char *command = mpd_getNextCommand(c);
+	Check(!command && c->error == MPD_ERROR_BUFFEROVERRUN, "line longer than limit is an error");
+	Check(c->bufsize == 2*MPD_BUFFER_INITIAL_LENGTH, "buffer doesn't grow past limit");
+	free(command);
+	mpd_closeConnection(c);
+	
+	c = mpd_newConnection("127.0.0.1", port, 10);
+	Check(c->error == 0, "connecting to fake mpd for nonblocking read");
+	mpd_sendCommandsCommand(c);
+	bool remembered = true;
+	Check(ReadAvailable(c, remembered) == 1, "response read without blocking is complete");
+	Check(remembered, "response isn't searched again from its start");
+	Check(c->bufsize > MPD_BUFFER_INITIAL_LENGTH, "full buffer grows while reading without blocking");
+	count = 0;
+	while (char *command = mpd_getNextCommand(c))
+	{
+		count++;
+		free(command);
+	}
+	mpd_finishCommand(c);
+	Check(c->error == 0 && count == 2000, "all lines of response read without blocking are there");
+	mpd_closeConnection(c);
+	
+	c = mpd_newConnection("127.0.0.1", port, 10);
+	Check(c->error == 0, "connecting to fake mpd for nonblocking overrun");
+	mpd_setBufferLimit(c, 2*MPD_BUFFER_INITIAL_LENGTH);
+	mpd_sendCommandsCommand(c);
+	Check(ReadAvailable(c, remembered) == 0 && c->error == MPD_ERROR_BUFFEROVERRUN, "full buffer at limit is an error, not complete response");
+	mpd_closeConnection(c);
+	
+	int status;
+	waitpid(server, &status, 0);
+	return failures ? 1 : 0;
+}
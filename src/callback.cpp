@@ -18,10 +18,12 @@
  *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
  ***************************************************************************/
 
+#include <algorithm>
 #include <curl/curl.h>
 #include <cstring>
 
 #include "callback.h"
+#include "http.h"
 #include "misc.h"
 #include "scrobby.h"
 #include "song.h"
@@ -29,8 +31,50 @@
 using std::string;
 
 extern Handshake myHandshake;
+extern HTTPClient myHTTPClient;
 extern MPD::Song s;
 
+namespace
+{
+	// notification waits until song has been current for a while, so
+	// that while skipping through playlist only the last one is sent
+	double now_playing_due = 0;
+	bool now_playing_in_flight = 0;
+	
+	unsigned now_playing_sent = 0;
+	unsigned now_playing_coalesced = 0;
+	
+	void NowPlayingSent(CURLcode code, const string &response, void *)
+	{
+		now_playing_in_flight = 0;
+		
+		string result = response;
+		IgnoreNewlines(result);
+		
+		if (result == "OK")
+		{
+			Log(llInfo, "Notification about currently playing song sent.");
+		}
+		else
+		{
+			if (result.empty())
+			{
+				Log(llError, "Error while sending notification: %s", curl_easy_strerror(code));
+			}
+			else
+			{
+				Log(llError, "Audioscrobbler returned status %s", result.c_str());
+				if (result == "BADSESSION")
+				{
+					myHandshake.Clear();
+					Log(llVerbose, "Handshake reset");
+					MPD::Song::NowPlayingNotify = 1;
+				}
+			}
+		}
+	}
+}
+
 void ScrobbyErrorCallback(MPD::Connection *, int, string errormessage, void *)
 {
 	IgnoreNewlines(errormessage);
@@ -41,27 +85,38 @@ void ScrobbyStatusChanged(MPD::Connection *Mpd, MPD::StatusChanges changed, void
 {
 	static MPD::State old_state = MPD::psUnknown;
 	static MPD::State current_state = MPD::psUnknown;
+	static int old_elapsed = 0;
+	static time_t last_update = 0;
 	
-	if (changed.Playlist)
+	// in idle mode there are no updates while song is just playing, so
+	// count the time that passed since previous update instead of ticks
+	time_t now = time(0);
+	if (current_state == MPD::psPlay && last_update)
+		s.Playback += now-last_update;
+	last_update = now;
+	
+	if (changed & MPD::scPlaylist)
 	{
 		// now playing song's metadata could change, so update it
 		s.SetData(Mpd->CurrentSong());
 	}
-	if (changed.State)
+	if (changed & MPD::scState)
 	{
+		// lost connection to mpd shows up as unknown state, so that
+		// time until it's back doesn't count as playback
 		old_state = current_state;
 		current_state = Mpd->GetState();
 		if (old_state == MPD::psStop && current_state == MPD::psPlay)
-			changed.SongID = 1;
+			changed |= MPD::scSongID;
 	}
-	if (changed.ElapsedTime)
+	if (changed & MPD::scElapsedTime)
 	{
-		
-		if (Mpd->GetElapsedTime() == Mpd->GetCrossfade() + 2)
-			changed.SongID = 1;
-		s.Playback++;
+		// song started over (f.e. it's on repeat), so treat it as a new one
+		if (Mpd->GetElapsedTime() < old_elapsed && Mpd->GetElapsedTime() <= Mpd->GetCrossfade() + 2)
+			changed |= MPD::scSongID;
+		old_elapsed = Mpd->GetElapsedTime();
 	}
-	if (changed.SongID || (old_state == MPD::psPlay && current_state == MPD::psStop))
+	if (changed & MPD::scSongID || (old_state == MPD::psPlay && current_state == MPD::psStop))
 	{
 		s.Submit();
 		
@@ -75,12 +130,26 @@ void ScrobbyStatusChanged(MPD::Connection *Mpd, MPD::StatusChanges changed, void
 		if (current_state == MPD::psPlay || current_state == MPD::psPause)
 		{
 			s.SetData(Mpd->CurrentSong());
+			// previous song's notification is superseded if still pending
+			if (MPD::Song::NowPlayingNotify)
+				now_playing_coalesced++;
 			MPD::Song::NowPlayingNotify = s.Queue.size()+s.SubmitQueue.size() != 1 && s.Data && !s.isStream();
+			now_playing_due = CurrentTime() + Config.now_playing_delay/1000.0;
 		}
 	}
-	
-	if (!MPD::Song::NowPlayingNotify || !s.Data)
-		 return;
+}
+
+int NowPlayingTimeout()
+{
+	if (!MPD::Song::NowPlayingNotify || !s.Data || now_playing_in_flight || !myHandshake.OK())
+		return -1;
+	return std::max(int((now_playing_due-CurrentTime())*1000)+1, 0);
+}
+
+void SendNowPlaying()
+{
+	if (!MPD::Song::NowPlayingNotify || !s.Data || now_playing_in_flight || CurrentTime() < now_playing_due)
+		return;
 	
 	MPD::Song::NowPlayingNotify = 0;
 	
@@ -107,77 +176,32 @@ void ScrobbyStatusChanged(MPD::Connection *Mpd, MPD::StatusChanges changed, void
 		Log(llVerbose, "Playing song detected: %s - %s", s.Data->artist, s.Data->title);
 		Log(llWarning, "Sending now playing notification...");
 		
-		std::ostringstream postdata;
-		string result, postdata_str;
-		CURLcode code;
-		
-		char *c_artist = curl_easy_escape(0, s.Data->artist, 0);
-		char *c_title = curl_easy_escape(0, s.Data->title, 0);
-		char *c_album = s.Data->album ? curl_easy_escape(0, s.Data->album, 0) : NULL;
-		char *c_track = s.Data->track ? curl_easy_escape(0, s.Data->track, 0) : NULL;
-		char *c_mb_trackid = s.Data->musicbrainz_trackid ? curl_easy_escape(0, s.Data->musicbrainz_trackid, 0) : NULL;
-		
-		postdata
-		<< "s=" << myHandshake.SessionID
-		<< "&a=" << c_artist
-		<< "&t=" << c_title
-		<< "&b=";
-		if (c_album)
-			postdata << c_album;
-		postdata << "&l=" << s.Data->time
-		<< "&n=";
-		if (c_track)
-			postdata << c_track;
-		postdata << "&m=";
-		if (c_mb_trackid)
-			postdata << c_mb_trackid;
-		
-		curl_free(c_artist);
-		curl_free(c_title);
-		curl_free(c_album);
-		curl_free(c_track);
-		curl_free(c_mb_trackid);
-		
-		postdata_str = postdata.str();
+		static string postdata;
+		postdata = "s=";
+		postdata += myHandshake.SessionID;
+		postdata += "&a=";
+		AppendEscaped(postdata, s.Data->artist, strlen(s.Data->artist));
+		postdata += "&t=";
+		AppendEscaped(postdata, s.Data->title, strlen(s.Data->title));
+		postdata += "&b=";
+		if (s.Data->album)
+			AppendEscaped(postdata, s.Data->album, strlen(s.Data->album));
+		postdata += "&l=";
+		postdata += IntoStr(s.Data->time);
+		postdata += "&n=";
+		if (s.Data->track)
+			AppendEscaped(postdata, s.Data->track, strlen(s.Data->track));
+		postdata += "&m=";
+		if (s.Data->musicbrainz_trackid)
+			AppendEscaped(postdata, s.Data->musicbrainz_trackid, strlen(s.Data->musicbrainz_trackid));
 		
 		Log(llVerbose, "URL: %s", myHandshake.NowPlayingURL.c_str());
-		Log(llVerbose, "Post data: %s", postdata_str.c_str());
-		
-		CURL *np_notification = curl_easy_init();
-		curl_easy_setopt(np_notification, CURLOPT_URL, myHandshake.NowPlayingURL.c_str());
-		curl_easy_setopt(np_notification, CURLOPT_POST, 1);
-		curl_easy_setopt(np_notification, CURLOPT_POSTFIELDS, postdata_str.c_str());
-		curl_easy_setopt(np_notification, CURLOPT_WRITEFUNCTION, write_data);
-		curl_easy_setopt(np_notification, CURLOPT_WRITEDATA, &result);
-		curl_easy_setopt(np_notification, CURLOPT_CONNECTTIMEOUT, curl_connecttimeout);
-		curl_easy_setopt(np_notification, CURLOPT_TIMEOUT, curl_timeout);
-		curl_easy_setopt(np_notification, CURLOPT_DNS_CACHE_TIMEOUT, 0);
-		curl_easy_setopt(np_notification, CURLOPT_NOPROGRESS, 1);
-		curl_easy_setopt(np_notification, CURLOPT_NOSIGNAL, 1);
-		code = curl_easy_perform(np_notification);
-		curl_easy_cleanup(np_notification);
+		Log(llVerbose, "Post data: %s", postdata.c_str());
 		
-		IgnoreNewlines(result);
-		
-		if (result == "OK")
-		{
-			Log(llInfo, "Notification about currently playing song sent.");
-		}
-		else
-		{
-			if (result.empty())
-			{
-				Log(llError, "Error while sending notification: %s", curl_easy_strerror(code));
-			}
-			else
-			{
-				Log(llError, "Audioscrobbler returned status %s", result.c_str());
-				// it can return only OK or BADSESSION, so if we are here, BADSESSION was returned.
-				myHandshake.Clear();
-				Log(llVerbose, "Handshake reset");
-				MPD::Song::NowPlayingNotify = 1;
-			}
-		}
+		myHTTPClient.Post(myHandshake.NowPlayingURL, postdata, curl_connecttimeout, curl_timeout, NowPlayingSent, 0);
+		now_playing_in_flight = 1;
+		now_playing_sent++;
+		Log(llVerbose, "Now playing notifications: %u sent, %u coalesced.", now_playing_sent, now_playing_coalesced);
 	}
 }
 
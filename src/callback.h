@@ -27,5 +27,8 @@
 void ScrobbyErrorCallback(MPD::Connection *, int, std::string, void *);
 void ScrobbyStatusChanged(MPD::Connection *, MPD::StatusChanges, void *);
 
+int NowPlayingTimeout();
+void SendNowPlaying();
+
 #endif
 
@@ -18,6 +18,7 @@
  *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
  ***************************************************************************/
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
@@ -42,6 +43,7 @@
 #endif
 
 #include "configuration.h"
+#include "libmpdclient.h"
 #include "misc.h"
 
 using std::string;
@@ -237,15 +239,24 @@ void DefaultConfiguration(ScrobbyConfig &conf)
 	conf.mpd_host = "localhost";
 	conf.mpd_port = 6600;
 	conf.mpd_timeout = 15;
+	conf.mpd_buffer_limit = MPD_BUFFER_MAX_LENGTH;
+	conf.queue_memory_limit = 1 << 20;
+	conf.queue_batches_in_flight = 1;
 	
 	conf.file_log = "/var/log/scrobby/scrobby.log";
 	conf.file_pid = "/var/run/scrobby/scrobby.pid";
 	conf.file_cache = "/var/cache/scrobby/scrobby.cache";
 	
+	conf.cache_sync = spInterval;
+	conf.cache_sync_interval = 5;
+	conf.cache_sync_records = 50;
+	
 	conf.log_level = llUndefined;
 	conf.daemonize = true;
 	
 	conf.submit_only_songs_with_mbid = false;
+	conf.compress_submissions = false;
+	conf.now_playing_delay = 1000;
 }
 
 bool ReadConfiguration(ScrobbyConfig &conf, const string &file)
@@ -283,6 +294,26 @@ bool ReadConfiguration(ScrobbyConfig &conf, const string &file)
 				if (!v.empty())
 					conf.mpd_timeout = StrToInt(v);
 			}
+			else if (line.find("mpd_buffer_limit") != string::npos)
+			{
+				if (!v.empty())
+					conf.mpd_buffer_limit = StrToInt(v);
+			}
+			else if (line.find("queue_memory_limit") != string::npos)
+			{
+				if (!v.empty())
+					conf.queue_memory_limit = StrToInt(v);
+			}
+			else if (line.find("queue_batches_in_flight") != string::npos)
+			{
+				if (!v.empty())
+					conf.queue_batches_in_flight = std::max(StrToInt(v), 1);
+			}
+			else if (line.find("now_playing_delay") != string::npos)
+			{
+				if (!v.empty())
+					conf.now_playing_delay = StrToInt(v);
+			}
 			else if (line.find("log_file") != string::npos)
 			{
 				if (!v.empty())
@@ -299,6 +330,25 @@ bool ReadConfiguration(ScrobbyConfig &conf, const string &file)
 					conf.file_pid = v;
 				}
 			}
+			else if (line.find("cache_sync_interval") != string::npos)
+			{
+				if (!v.empty())
+					conf.cache_sync_interval = StrToInt(v);
+			}
+			else if (line.find("cache_sync_records") != string::npos)
+			{
+				if (!v.empty())
+					conf.cache_sync_records = StrToInt(v);
+			}
+			else if (line.find("cache_sync") != string::npos)
+			{
+				if (v == "none")
+					conf.cache_sync = spNone;
+				else if (v == "interval")
+					conf.cache_sync = spInterval;
+				else if (v == "always")
+					conf.cache_sync = spAlways;
+			}
 			else if (line.find("cache_file") != string::npos)
 			{
 				if (!v.empty())
@@ -327,6 +377,12 @@ bool ReadConfiguration(ScrobbyConfig &conf, const string &file)
 				if (!v.empty() && conf.log_level == llUndefined)
 					conf.log_level = IntoLogLevel(v);
 			}
+			else if (line.find("compress_submissions") != string::npos)
+			{
+				if (!v.empty()) // default is false
+					if (v == "1" || v == "true" || v == "yes")
+						conf.compress_submissions = true;
+			}
 			else if (line.find("submit_only_songs_with_mbid") != string::npos)
 			{
 				if (!v.empty()) // default is false
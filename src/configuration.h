@@ -24,6 +24,7 @@
 #include <string>
 
 enum LogLevel { llUndefined, llNone, llError, llWarning, llInfo, llVerbose };
+enum SyncPolicy { spNone, spInterval, spAlways };
 
 struct ScrobbyConfig
 {
@@ -33,12 +34,19 @@ struct ScrobbyConfig
 	std::string mpd_host;
 	int mpd_port;
 	int mpd_timeout;
+	int mpd_buffer_limit;
+	int queue_memory_limit;
+	int queue_batches_in_flight;
 	
 	std::string file_config;
 	std::string file_log;
 	std::string file_pid;
 	std::string file_cache;
 	
+	SyncPolicy cache_sync;
+	int cache_sync_interval;
+	int cache_sync_records;
+	
 	std::string lastfm_user;
 	std::string lastfm_password;
 	std::string lastfm_md5_password;
@@ -47,6 +55,8 @@ struct ScrobbyConfig
 	bool daemonize;
 	
 	bool submit_only_songs_with_mbid;
+	bool compress_submissions;
+	int now_playing_delay;
 };
 
 extern ScrobbyConfig Config;
@@ -0,0 +1,176 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+// opens thousands of connections to fake mpd, so that their descriptors
+// go past FD_SETSIZE, and checks that commands still work on all of them
+// usage: connection_check [connections]
+
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "libmpdclient.h"
+
+namespace
+{
+	int failures = 0;
+	
+	void Check(bool ok, const char *what)
+	{
+		if (!ok)
+		{
+			fprintf(stderr, "FAIL: %s\n", what);
+			failures++;
+		}
+	}
+	
+	void Reply(int fd, const char *data)
+	{
+		size_t length = strlen(data);
+		if (write(fd, data, length) != ssize_t(length))
+			close(fd);
+	}
+	
+	// plays mpd for all connections at once, every command is answered
+	// with the same status
+	void Serve(int listener)
+	{
+		std::vector<pollfd> fds;
+		pollfd l = { listener, POLLIN, 0 };
+		fds.push_back(l);
+		while (true)
+		{
+			if (poll(&fds[0], fds.size(), -1) < 0)
+				_exit(1);
+			for (size_t i = fds.size(); i-- > 1; )
+			{
+				if (!fds[i].revents)
+					continue;
+				char buf[256];
+				ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+				if (n <= 0)
+				{
+					close(fds[i].fd);
+					fds.erase(fds.begin()+i);
+					continue;
+				}
+				for (ssize_t j = 0; j < n; j++)
+					if (buf[j] == '\n')
+						Reply(fds[i].fd, "volume: 50\nstate: play\nsongid: 7\nOK\n");
+			}
+			if (fds[0].revents)
+			{
+				pollfd c = { accept(listener, 0, 0), POLLIN, 0 };
+				if (c.fd < 0)
+					_exit(1);
+				Reply(c.fd, "OK MPD 0.15.0\n");
+				fds.push_back(c);
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int connections = argc > 1 ? atoi(argv[1]) : 3000;
+	
+	// each side holds one descriptor per connection
+	rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	rlim_t wanted = connections+64;
+	if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < wanted)
+	{
+		fprintf(stderr, "descriptor limit is too low for %d connections, skipping\n", connections);
+		return 77;
+	}
+	if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur < wanted)
+	{
+		limit.rlim_cur = wanted;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+	||  listen(listener, SOMAXCONN) != 0 || getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &addr_len) != 0)
+	{
+		perror("listen");
+		return 1;
+	}
+	int port = ntohs(addr.sin_port);
+	
+	signal(SIGPIPE, SIG_IGN);
+	pid_t server = fork();
+	if (server == 0)
+		Serve(listener);
+	close(listener);
+	
+	std::vector<mpd_Connection *> open;
+	int highest = -1;
+	for (int i = 0; i < connections; i++)
+	{
+		mpd_Connection *c = mpd_newConnection("127.0.0.1", port, 10);
+		if (c->error)
+		{
+			fprintf(stderr, "connection %d: %s\n", i, c->errorStr);
+			mpd_closeConnection(c);
+			break;
+		}
+		if (c->sock > highest)
+			highest = c->sock;
+		open.push_back(c);
+	}
+	Check(int(open.size()) == connections, "all connections are made");
+	Check(highest >= FD_SETSIZE, "descriptors go past FD_SETSIZE");
+	
+	// commands go both ways over the newest connections first, they're
+	// the ones select() couldn't handle
+	int answered = 0;
+	for (size_t i = open.size(); i-- > 0; )
+	{
+		mpd_sendStatusCommand(open[i]);
+		mpd_Status *status = mpd_getStatus(open[i]);
+		if (status && open[i]->error == 0 && status->volume == 50 && status->songid == 7)
+			answered++;
+		if (status)
+			mpd_freeStatus(status);
+	}
+	Check(answered == int(open.size()), "status is read over every connection");
+	
+	for (size_t i = 0; i < open.size(); i++)
+		mpd_closeConnection(open[i]);
+	kill(server, SIGTERM);
+	waitpid(server, 0, 0);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,118 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+// measures how fast tags of a big backlog are percent-encoded for
+// submission, with AppendEscaped and with curl_easy_escape. tags are
+// mostly non-ascii, so that most bytes have to be encoded.
+// usage: escape_bench [songs]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <curl/curl.h>
+#include <string>
+#include <vector>
+
+#include "misc.h"
+
+using std::string;
+
+namespace
+{
+	const char *artists[] = {
+		"Björk Guðmundsdóttir", "Пётр Ильич Чайковский", "坂本龍一",
+		"Sigur Rós", "Mötley Crüe", "Ελευθερία Αρβανιτάκη", "طلال مداح",
+		"Zbigniew Preisner"
+	};
+	const char *titles[] = {
+		"Ágætis byrjun", "Лебединое озеро, соч. 20", "戦場のメリークリスマス",
+		"Hoppípolla", "Kickstart My Heart", "Το παράπονο", "مقادير",
+		"Lacrimosa (Dies iræ)"
+	};
+	const char *albums[] = {
+		"Homogenic", "Балеты", "音楽図鑑", "Takk…", "Dr. Feelgood",
+		"Ελευθερία Αρβανιτάκη – Τα τραγούδια", "صوت الأرض",
+		"La double vie de Véronique"
+	};
+	
+	// tags of one song are encoded the way they go into submission
+	typedef void (*Escape)(string &, const string &);
+	
+	void Native(string &out, const string &tag)
+	{
+		AppendEscaped(out, tag);
+	}
+	
+	void Curl(string &out, const string &tag)
+	{
+		char *escaped = curl_easy_escape(0, tag.data(), tag.length());
+		out += escaped;
+		curl_free(escaped);
+	}
+	
+	// returns the best time of a few rounds
+	double Measure(const std::vector<string> &tags, Escape escape, string &out)
+	{
+		double best = 0;
+		for (int round = 0; round < 5; round++)
+		{
+			double start = CurrentTime();
+			out.clear();
+			for (size_t i = 0; i < tags.size(); i++)
+			{
+				out += "&t=";
+				escape(out, tags[i]);
+			}
+			double elapsed = CurrentTime()-start;
+			if (round == 0 || elapsed < best)
+				best = elapsed;
+		}
+		return best;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int songs = argc > 1 ? atoi(argv[1]) : 100000;
+	
+	const size_t count = sizeof(artists)/sizeof(*artists);
+	std::vector<string> tags;
+	size_t bytes = 0;
+	for (int i = 0; i < songs; i++)
+	{
+		tags.push_back(artists[i % count]);
+		tags.push_back(titles[(i/count) % count]);
+		tags.push_back(albums[(i/3) % count]);
+		for (int j = 1; j <= 3; j++)
+			bytes += tags[tags.size()-j].length();
+	}
+	
+	string native, curl;
+	double native_time = Measure(tags, Native, native);
+	double curl_time = Measure(tags, Curl, curl);
+	if (native != curl)
+	{
+		fprintf(stderr, "AppendEscaped and curl_easy_escape differ\n");
+		return 1;
+	}
+	printf("%d songs, %.1f MB of tags: AppendEscaped %.1f ms (%.0f MB/s), curl_easy_escape %.1f ms (%.0f MB/s)\n",
+	       songs, bytes/1e6, native_time*1000, bytes/native_time/1e6, curl_time*1000, bytes/curl_time/1e6);
+	return 0;
+}
@@ -0,0 +1,87 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+// checks that AppendEscaped gives the same output as curl_easy_escape
+
+#include <cstdio>
+#include <cstdlib>
+#include <curl/curl.h>
+#include <string>
+
+#include "misc.h"
+
+using std::string;
+
+namespace
+{
+	int failures = 0;
+	
+	void Compare(const string &in, const string &prefix)
+	{
+		char *expected = curl_easy_escape(0, in.data(), in.length());
+		string out = prefix;
+		AppendEscaped(out, in);
+		if (out != prefix + expected)
+		{
+			fprintf(stderr, "FAIL: input of length %u:\n  expected: %s\n  got: %s\n",
+				unsigned(in.length()), expected, out.substr(prefix.length()).c_str());
+			failures++;
+		}
+		curl_free(expected);
+	}
+}
+
+int main()
+{
+	// vectorized path handles 16 bytes at a time, so lengths around
+	// one and two blocks exercise both it and the scalar tail
+	const size_t lengths[] = { 0, 1, 15, 16, 17, 31, 32, 33 };
+	const char backgrounds[] = { 'a', '%', char(0xc3) };
+	
+	for (int c = 0; c < 256; c++)
+	{
+		for (size_t l = 0; l < sizeof(lengths)/sizeof(*lengths); l++)
+		{
+			Compare(string(lengths[l], char(c)), "");
+			// the byte at every position of other bytes
+			for (size_t b = 0; b < sizeof(backgrounds); b++)
+			{
+				for (size_t pos = 0; pos < lengths[l]; pos++)
+				{
+					string in(lengths[l], backgrounds[b]);
+					in[pos] = c;
+					Compare(in, "a=");
+				}
+			}
+		}
+	}
+	
+	// mixed input, including multibyte characters
+	srand(1);
+	for (int n = 0; n < 100000; n++)
+	{
+		string in(rand() % 70, 0);
+		for (size_t i = 0; i < in.length(); i++)
+			in[i] = rand() % 4 ? "abcXYZ09-._~ %&/"[rand() % 16] : rand() % 256;
+		Compare(in, "&t=");
+	}
+	
+	return failures ? 1 : 0;
+}
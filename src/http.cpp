@@ -0,0 +1,301 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <cstdio>
+#include <sys/time.h>
+
+#include "http.h"
+#include "misc.h"
+
+using std::string;
+
+namespace
+{
+	long long Now()
+	{
+		timeval tv;
+		gettimeofday(&tv, 0);
+		return tv.tv_sec*1000LL + tv.tv_usec/1000;
+	}
+}
+
+HTTPClient::HTTPClient() : itsReactor(0),
+			   itsDeadline(-1),
+			   itsRequests(0),
+			   itsReusedConnections(0)
+{
+	itsMulti = curl_multi_init();
+	curl_multi_setopt(itsMulti, CURLMOPT_SOCKETFUNCTION, SocketChanged);
+	curl_multi_setopt(itsMulti, CURLMOPT_SOCKETDATA, this);
+	curl_multi_setopt(itsMulti, CURLMOPT_TIMERFUNCTION, TimerChanged);
+	curl_multi_setopt(itsMulti, CURLMOPT_TIMERDATA, this);
+}
+
+HTTPClient::~HTTPClient()
+{
+	// reactor may be already gone, pending requests are abandoned
+	itsReactor = 0;
+	curl_multi_cleanup(itsMulti);
+	for (std::vector<CURL *>::iterator it = itsFreeHandles.begin(); it != itsFreeHandles.end(); it++)
+		curl_easy_cleanup(*it);
+}
+
+void HTTPClient::Attach(Reactor *reactor)
+{
+	itsReactor = reactor;
+	// without asynchronous resolver curl looks names up inside the loop
+	curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+	if (!(info->features & CURL_VERSION_ASYNCHDNS))
+		Log(llVerbose, "libcurl resolves host names synchronously, lookups will block the main loop.");
+}
+
+void HTTPClient::Get(const string &url, int connect_timeout, int timeout, Completion callback, void *data)
+{
+	Request *r = new Request;
+	r->Callback = callback;
+	r->Userdata = data;
+	CURL *handle = Prepare(r, url, connect_timeout, timeout);
+	curl_easy_setopt(handle, CURLOPT_HTTPGET, 1);
+	Start(handle);
+}
+
+void HTTPClient::Post(const string &url, const string &data, int connect_timeout, int timeout, Completion callback, void *userdata, bool compress)
+{
+	Request *r = new Request;
+	r->Data = data;
+	r->Callback = callback;
+	r->Userdata = userdata;
+	CURL *handle = Prepare(r, url, connect_timeout, timeout);
+	curl_easy_setopt(handle, CURLOPT_POST, 1);
+#	ifdef HAVE_LIBZ
+	if (compress)
+	{
+		r->Deflate = new z_stream;
+		r->Deflate->zalloc = Z_NULL;
+		r->Deflate->zfree = Z_NULL;
+		r->Deflate->opaque = Z_NULL;
+		// 15+16 means default window with gzip header
+		if (deflateInit2(r->Deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			Log(llWarning, "Couldn't initialize compression, sending request uncompressed.");
+			delete r->Deflate;
+			r->Deflate = 0;
+		}
+	}
+	if (r->Deflate)
+	{
+		Rewind(r);
+		r->Headers = curl_slist_append(r->Headers, "Content-Encoding: gzip");
+		// size isn't known in advance, so body goes chunked
+		r->Headers = curl_slist_append(r->Headers, "Transfer-Encoding: chunked");
+		curl_easy_setopt(handle, CURLOPT_HTTPHEADER, r->Headers);
+		curl_easy_setopt(handle, CURLOPT_READFUNCTION, ReadCompressed);
+		curl_easy_setopt(handle, CURLOPT_READDATA, r);
+		curl_easy_setopt(handle, CURLOPT_SEEKFUNCTION, SeekCompressed);
+		curl_easy_setopt(handle, CURLOPT_SEEKDATA, r);
+		Start(handle);
+		return;
+	}
+#	else
+	if (compress)
+		Log(llVerbose, "Compression is not supported, sending request uncompressed.");
+#	endif // HAVE_LIBZ
+	curl_easy_setopt(handle, CURLOPT_POSTFIELDS, r->Data.c_str());
+	curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, long(r->Data.length()));
+	Start(handle);
+}
+
+int HTTPClient::GetTimeout() const
+{
+	if (itsDeadline < 0)
+		return -1;
+	long long left = itsDeadline-Now();
+	return left > 0 ? left : 0;
+}
+
+void HTTPClient::CheckTimeout()
+{
+	if (itsDeadline < 0 || itsDeadline > Now())
+		return;
+	itsDeadline = -1;
+	int running;
+	curl_multi_socket_action(itsMulti, CURL_SOCKET_TIMEOUT, 0, &running);
+	Finish();
+}
+
+CURL *HTTPClient::Prepare(Request *r, const string &url, int connect_timeout, int timeout)
+{
+	r->Headers = 0;
+#	ifdef HAVE_LIBZ
+	r->Deflate = 0;
+#	endif // HAVE_LIBZ
+	
+	CURL *handle;
+	if (itsFreeHandles.empty())
+		handle = curl_easy_init();
+	else
+	{
+		handle = itsFreeHandles.back();
+		itsFreeHandles.pop_back();
+	}
+	curl_easy_setopt(handle, CURLOPT_PRIVATE, r);
+	curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_data);
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &r->Result);
+	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, connect_timeout);
+	curl_easy_setopt(handle, CURLOPT_TIMEOUT, timeout);
+	curl_easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT, 0);
+	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1);
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1);
+	return handle;
+}
+
+void HTTPClient::Start(CURL *handle)
+{
+	// curl sets timer to start the transfer from the main loop
+	curl_multi_add_handle(itsMulti, handle);
+}
+
+void HTTPClient::Finish()
+{
+	CURLMsg *msg;
+	int left;
+	while ((msg = curl_multi_info_read(itsMulti, &left)))
+	{
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		
+		CURL *handle = msg->easy_handle;
+		CURLcode code = msg->data.result;
+		Request *r;
+		curl_easy_getinfo(handle, CURLINFO_PRIVATE, &r);
+		
+		if (code == CURLE_OK)
+		{
+			// no new connections means that an open one was reused
+			long connects = 0;
+			curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+			itsRequests++;
+			if (connects == 0)
+				itsReusedConnections++;
+			Log(llVerbose, "HTTP connection %s, reused for %u of %u requests.", connects ? "opened" : "reused", itsReusedConnections, itsRequests);
+#			ifdef HAVE_LIBZ
+			if (r->Deflate)
+				Log(llVerbose, "Request body compressed from %u to %lu bytes.", unsigned(r->Data.length()), r->Deflate->total_out);
+#			endif // HAVE_LIBZ
+		}
+		
+		curl_multi_remove_handle(itsMulti, handle);
+		curl_easy_reset(handle);
+		itsFreeHandles.push_back(handle);
+		
+		curl_slist_free_all(r->Headers);
+#		ifdef HAVE_LIBZ
+		if (r->Deflate)
+		{
+			deflateEnd(r->Deflate);
+			delete r->Deflate;
+		}
+#		endif // HAVE_LIBZ
+		
+		// callback may start new requests, so it goes last
+		if (r->Callback)
+			r->Callback(code, r->Result, r->Userdata);
+		delete r;
+	}
+}
+
+#ifdef HAVE_LIBZ
+size_t HTTPClient::ReadCompressed(char *buffer, size_t size, size_t nmemb, void *data)
+{
+	Request *r = static_cast<Request *>(data);
+	r->Deflate->next_out = reinterpret_cast<Bytef *>(buffer);
+	r->Deflate->avail_out = size*nmemb;
+	// whole input is there, so each call just fills curl's buffer
+	// with as much as it can hold, end of stream means end of body
+	int result = deflate(r->Deflate, Z_FINISH);
+	if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+		return CURL_READFUNC_ABORT;
+	return size*nmemb - r->Deflate->avail_out;
+}
+
+int HTTPClient::SeekCompressed(void *data, curl_off_t offset, int origin)
+{
+	// curl only rewinds to resend body on a new connection
+	if (offset != 0 || origin != SEEK_SET)
+		return CURL_SEEKFUNC_CANTSEEK;
+	Rewind(static_cast<Request *>(data));
+	return CURL_SEEKFUNC_OK;
+}
+
+void HTTPClient::Rewind(Request *r)
+{
+	deflateReset(r->Deflate);
+	r->Deflate->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(r->Data.data()));
+	r->Deflate->avail_in = r->Data.length();
+}
+#endif // HAVE_LIBZ
+
+int HTTPClient::SocketChanged(CURL *, curl_socket_t s, int what, void *data, void *watched)
+{
+	HTTPClient *client = static_cast<HTTPClient *>(data);
+	if (!client->itsReactor)
+		return 0;
+	
+	int events = ioNone;
+	if (what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+		events |= ioRead;
+	if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+		events |= ioWrite;
+	
+	if (what == CURL_POLL_REMOVE)
+	{
+		client->itsReactor->Remove(s);
+		curl_multi_assign(client->itsMulti, s, 0);
+	}
+	else if (watched)
+		client->itsReactor->Modify(s, events);
+	else
+	{
+		client->itsReactor->Add(s, events, SocketReady, client);
+		curl_multi_assign(client->itsMulti, s, client);
+	}
+	return 0;
+}
+
+int HTTPClient::TimerChanged(CURLM *, long timeout, void *data)
+{
+	HTTPClient *client = static_cast<HTTPClient *>(data);
+	client->itsDeadline = timeout < 0 ? -1 : Now()+timeout;
+	return 0;
+}
+
+void HTTPClient::SocketReady(int fd, int events, void *data)
+{
+	HTTPClient *client = static_cast<HTTPClient *>(data);
+	int flags = 0;
+	if (events & ioRead)
+		flags |= CURL_CSELECT_IN;
+	if (events & ioWrite)
+		flags |= CURL_CSELECT_OUT;
+	int running;
+	curl_multi_socket_action(client->itsMulti, fd, flags, &running);
+	client->Finish();
+}
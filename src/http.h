@@ -0,0 +1,101 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef _HTTP_H
+#define _HTTP_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <curl/curl.h>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
+
+#include "reactor.h"
+
+/// asynchronous http client driven by curl multi interface, its sockets
+/// are watched by the reactor, so requests don't block the main loop.
+/// connections are kept open between requests and reused.
+class HTTPClient
+{
+	typedef void (*Completion) (CURLcode, const std::string &, void *);
+	
+	public:
+		HTTPClient();
+		~HTTPClient();
+		
+		void Attach(Reactor *);
+		
+		void Get(const std::string &url, int connect_timeout, int timeout, Completion, void *);
+		void Post(const std::string &url, const std::string &data, int connect_timeout, int timeout, Completion, void *, bool compress = false);
+		
+		int GetTimeout() const;
+		void CheckTimeout();
+		
+		unsigned GetRequests() const { return itsRequests; }
+		unsigned GetReusedConnections() const { return itsReusedConnections; }
+		
+	private:
+		struct Request
+		{
+			std::string Data;
+			std::string Result;
+			Completion Callback;
+			void *Userdata;
+			curl_slist *Headers;
+#			ifdef HAVE_LIBZ
+			// body is compressed on the fly while curl sends it
+			z_stream *Deflate;
+#			endif // HAVE_LIBZ
+		};
+		
+		CURL *Prepare(Request *, const std::string &url, int connect_timeout, int timeout);
+		void Start(CURL *);
+		void Finish();
+		
+#		ifdef HAVE_LIBZ
+		static size_t ReadCompressed(char *, size_t, size_t, void *);
+		static int SeekCompressed(void *, curl_off_t, int);
+		static void Rewind(Request *);
+#		endif // HAVE_LIBZ
+		
+		static int SocketChanged(CURL *, curl_socket_t, int, void *, void *);
+		static int TimerChanged(CURLM *, long, void *);
+		static void SocketReady(int, int, void *);
+		
+		CURLM *itsMulti;
+		Reactor *itsReactor;
+		
+		std::vector<CURL *> itsFreeHandles;
+		
+		// when curl wants to be woken up (ms since epoch), -1 if never
+		long long itsDeadline;
+		
+		unsigned itsRequests;
+		unsigned itsReusedConnections;
+};
+
+#endif
+
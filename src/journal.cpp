@@ -0,0 +1,690 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "misc.h"
+
+using std::string;
+
+namespace
+{
+	const char journal_magic[4] = { 'S', 'C', 'B', 'J' };
+	// version 1 had no record types, all records were songs
+	const unsigned journal_version = 2;
+	
+	const char song_record = 'S';
+	const char ack_record = 'A';
+	
+	const size_t header_size = 8;
+	const size_t record_header_size = 8;
+	
+	// scrobble takes at most a few hundred bytes, anything much bigger
+	// means that length itself is damaged
+	const size_t max_record_size = 1 << 16;
+	
+	unsigned crc_table[256];
+	
+	void InitCrcTable()
+	{
+		for (unsigned i = 0; i < 256; i++)
+		{
+			unsigned crc = i;
+			for (int j = 0; j < 8; j++)
+				crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+			crc_table[i] = crc;
+		}
+	}
+	
+	void PutUInt32(string &out, unsigned n)
+	{
+		out += char(n & 0xff);
+		out += char((n >> 8) & 0xff);
+		out += char((n >> 16) & 0xff);
+		out += char((n >> 24) & 0xff);
+	}
+	
+	unsigned GetUInt32(const char *p)
+	{
+		const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+		return u[0] | (u[1] << 8) | (u[2] << 16) | (unsigned(u[3]) << 24);
+	}
+	
+	void PutHeader(string &out)
+	{
+		out.append(journal_magic, sizeof(journal_magic));
+		PutUInt32(out, journal_version);
+	}
+	
+	void PutRecord(string &out, char type, const string &record)
+	{
+		string payload;
+		payload.reserve(record.length()+1);
+		payload += type;
+		payload += record;
+		PutUInt32(out, payload.length());
+		PutUInt32(out, Crc32c(payload.data(), payload.length()));
+		out += payload;
+	}
+	
+	string AckOffset(long long offset)
+	{
+		string result;
+		PutUInt32(result, offset & 0xffffffff);
+		PutUInt32(result, offset >> 32);
+		return result;
+	}
+	
+	bool WriteAll(int fd, const string &data)
+	{
+		const char *p = data.data();
+		size_t left = data.length();
+		while (left > 0)
+		{
+			ssize_t n = write(fd, p, left);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			left -= n;
+		}
+		return true;
+	}
+	
+	// makes rename of a file in it durable
+	bool SyncDirectory(const string &file)
+	{
+		size_t slash = file.rfind('/');
+		string dir = slash == string::npos ? "." : file.substr(0, slash ? slash : 1);
+		int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			return false;
+		bool result = fsync(fd) == 0;
+		close(fd);
+		return result;
+	}
+	
+	void ReadText(const string &file, std::vector<string> &records)
+	{
+		std::ifstream f(file.c_str());
+		string line;
+		while (getline(f, line))
+			if (!line.empty())
+				records.push_back(line);
+	}
+}
+
+unsigned Crc32c(const char *data, size_t length)
+{
+	if (!crc_table[1])
+		InitCrcTable();
+	unsigned crc = 0xffffffff;
+	for (size_t i = 0; i < length; i++)
+		crc = crc_table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+JournalWriter::JournalWriter() : itsFD(-1),
+				 itsSize(0),
+				 itsPolicy(spInterval),
+				 itsInterval(5),
+				 itsRecords(50),
+				 itsWorker(0),
+				 itsAckHandler(0),
+				 itsAckUserdata(0),
+				 itsGeneration(0),
+				 isSyncing(0),
+				 itsSyncAgain(0),
+				 itsCheckpoint(0),
+				 itsSyncedCheckpoint(0),
+				 itsUnsynced(0),
+				 itsFirstUnsynced(0)
+{
+}
+
+JournalWriter::~JournalWriter()
+{
+	Close();
+}
+
+void JournalWriter::SetPolicy(SyncPolicy policy, int interval, int records)
+{
+	itsPolicy = policy;
+	itsInterval = interval;
+	itsRecords = records;
+}
+
+void JournalWriter::SetWorker(Worker *worker)
+{
+	itsWorker = worker;
+}
+
+void JournalWriter::SetAckHandler(AckHandler handler, void *data)
+{
+	itsAckHandler = handler;
+	itsAckUserdata = data;
+}
+
+bool JournalWriter::Open(const string &file)
+{
+	Close();
+	itsFile = file;
+	itsFD = open(file.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+	struct stat st;
+	if (itsFD < 0 || fstat(itsFD, &st) != 0)
+	{
+		Close();
+		return false;
+	}
+	itsSize = st.st_size;
+	
+	// records are never appended to file in other format
+	char header[header_size];
+	if (itsSize > 0 && (pread(itsFD, header, header_size, 0) != ssize_t(header_size)
+	||  memcmp(header, journal_magic, sizeof(journal_magic)) != 0
+	||  GetUInt32(header+sizeof(journal_magic)) != journal_version))
+	{
+		Close();
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+}
+
+void JournalWriter::Close()
+{
+	itsGeneration++;
+	isSyncing = 0;
+	itsSyncAgain = 0;
+	itsCheckpoint = 0;
+	itsSyncedCheckpoint = 0;
+	itsUnsynced = 0;
+	if (itsFD < 0)
+		return;
+	close(itsFD);
+	itsFD = -1;
+}
+
+long long JournalWriter::Append(const string &record)
+{
+	long long offset = Write(song_record, record);
+	if (offset < 0)
+		return -1;
+	if (itsUnsynced++ == 0)
+		itsFirstUnsynced = CurrentTime();
+	if (itsPolicy == spAlways || (itsPolicy == spInterval && itsUnsynced >= itsRecords))
+		Sync();
+	return offset;
+}
+
+long long JournalWriter::Ack(long long offset)
+{
+	long long end = Write(ack_record, offset < 0 ? string() : AckOffset(offset));
+	if (end < 0)
+		return -1;
+	itsCheckpoint = offset < 0 ? end : offset;
+	// checkpoint has to survive a crash, otherwise accepted songs
+	// would be submitted again. it's counted as pending record, so
+	// that failed sync is retried like for songs.
+	if (itsUnsynced++ == 0)
+		itsFirstUnsynced = CurrentTime();
+	Sync();
+	return itsCheckpoint;
+}
+
+void JournalWriter::Sync()
+{
+	if (itsFD < 0 || itsUnsynced == 0)
+		return;
+	// one sync at a time, the next one covers what was written meanwhile
+	if (isSyncing)
+	{
+		itsSyncAgain = 1;
+		return;
+	}
+	
+	// worker gets its own descriptor, so that it doesn't matter
+	// if this one is closed before sync is done
+	SyncJob *job = new SyncJob;
+	job->Writer = this;
+	job->Generation = itsGeneration;
+	job->FD = dup(itsFD);
+	job->Records = itsUnsynced;
+	job->Checkpoint = itsCheckpoint;
+	job->Error = 0;
+	isSyncing = 1;
+	itsUnsynced = 0;
+	if (itsWorker)
+		itsWorker->Post(RunSync, SyncDone, job);
+	else
+	{
+		RunSync(job);
+		SyncDone(job);
+	}
+}
+
+bool JournalWriter::Flush()
+{
+	if (itsWorker)
+		itsWorker->Wait();
+	if (itsFD < 0)
+		return false;
+	Worker *worker = itsWorker;
+	itsWorker = 0;
+	Sync();
+	itsWorker = worker;
+	return itsUnsynced == 0;
+}
+
+int JournalWriter::GetTimeout() const
+{
+	// running sync will pick up the rest when it's done
+	if (itsPolicy != spInterval || itsUnsynced == 0 || isSyncing)
+		return -1;
+	double left = itsFirstUnsynced + itsInterval - CurrentTime();
+	return left > 0 ? int(left*1000)+1 : 0;
+}
+
+void JournalWriter::CheckTimeout()
+{
+	if (GetTimeout() == 0)
+		Sync();
+}
+
+void JournalWriter::RunSync(void *data)
+{
+	SyncJob *job = static_cast<SyncJob *>(data);
+	if (job->FD < 0 || fdatasync(job->FD) != 0)
+		job->Error = job->FD < 0 ? EBADF : errno;
+	if (job->FD >= 0)
+		close(job->FD);
+}
+
+void JournalWriter::SyncDone(void *data)
+{
+	SyncJob *job = static_cast<SyncJob *>(data);
+	JournalWriter *w = job->Writer;
+	if (job->Generation == w->itsGeneration)
+	{
+		w->isSyncing = 0;
+		if (job->Error)
+		{
+			// records stay pending, so that sync is retried, but not
+			// before another interval passes
+			Log(llError, "Couldn't sync cache: %s", strerror(job->Error));
+			w->itsUnsynced += job->Records;
+			w->itsFirstUnsynced = CurrentTime();
+		}
+		else if (job->Checkpoint > w->itsSyncedCheckpoint)
+		{
+			w->itsSyncedCheckpoint = job->Checkpoint;
+			if (w->itsAckHandler)
+				w->itsAckHandler(job->Checkpoint, w->itsAckUserdata);
+		}
+		if (w->itsSyncAgain)
+		{
+			w->itsSyncAgain = 0;
+			w->Sync();
+		}
+	}
+	delete job;
+}
+
+long long JournalWriter::Write(char type, const string &record)
+{
+	if (itsFD < 0)
+		return -1;
+	
+	// encoding buffer keeps its capacity between records
+	static string data;
+	data.clear();
+	if (itsSize == 0)
+		PutHeader(data);
+	long long offset = itsSize + data.length();
+	
+	// checkpoint without offset covers everything written so far
+	if (type == ack_record && record.empty())
+		PutRecord(data, type, AckOffset(offset));
+	else
+		PutRecord(data, type, record);
+	
+	// one write per record, so that it's either there or torn at the end
+	if (!WriteAll(itsFD, data))
+	{
+		// drop torn record, so that next ones don't end up behind it
+		struct stat st;
+		if (ftruncate(itsFD, itsSize) != 0 && fstat(itsFD, &st) == 0)
+			itsSize = st.st_size;
+		return -1;
+	}
+	itsSize += data.length();
+	return offset;
+}
+
+bool JournalRewrite(const string &file, const std::vector<string> &records, std::vector<long long> &offsets)
+{
+	string data;
+	PutHeader(data);
+	offsets.clear();
+	for (std::vector<string>::const_iterator it = records.begin(); it != records.end(); it++)
+	{
+		offsets.push_back(data.length());
+		PutRecord(data, song_record, *it);
+	}
+	
+	// new journal replaces the old one at once, so crash in the middle
+	// leaves either of them intact
+	string tmp = file + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	bool result = WriteAll(fd, data) && fsync(fd) == 0;
+	close(fd);
+	if (!result || rename(tmp.c_str(), file.c_str()) != 0)
+	{
+		unlink(tmp.c_str());
+		return false;
+	}
+	// new journal is in place already, so offsets are valid even if
+	// the rename itself may not survive a crash yet
+	if (!SyncDirectory(file))
+		Log(llError, "Couldn't sync cache directory: %s", strerror(errno));
+	return true;
+}
+
+JournalReader::JournalReader() : itsFD(-1),
+				 itsData(0),
+				 itsSize(0),
+				 itsMapped(0),
+				 itsPosition(0),
+				 itsAcked(0),
+				 itsAppended(0),
+				 isDamaged(0)
+{
+}
+
+JournalReader::~JournalReader()
+{
+	Close();
+}
+
+bool JournalReader::Open(const string &file)
+{
+	Close();
+	itsAcked = 0;
+	isDamaged = 0;
+	
+	itsFD = open(file.c_str(), O_RDONLY);
+	struct stat st;
+	if (itsFD < 0 || fstat(itsFD, &st) != 0 || size_t(st.st_size) < header_size || !Map(st.st_size))
+	{
+		Close();
+		return false;
+	}
+	if (memcmp(itsData, journal_magic, sizeof(journal_magic)) != 0 || GetUInt32(itsData+sizeof(journal_magic)) != journal_version)
+	{
+		Close();
+		return false;
+	}
+	
+	// only lengths are followed here to find the last checkpoint and cut
+	// torn tail, so that writer appends right after whole records. songs
+	// are checked later by Next(), only checkpoints have to be now.
+	size_t pos = header_size;
+	while (pos + record_header_size <= itsSize)
+	{
+		size_t length = GetUInt32(itsData+pos);
+		if (length > max_record_size || pos + record_header_size + length > itsSize)
+			break;
+		const char *payload = itsData+pos+record_header_size;
+		if (length == 9 && payload[0] == ack_record && Crc32c(payload, length) == GetUInt32(itsData+pos+4))
+			itsAcked = GetUInt32(payload+1) | (static_cast<long long>(GetUInt32(payload+5)) << 32);
+		pos += record_header_size + length;
+	}
+	if (pos < itsSize)
+	{
+		Log(llWarning, "Cache is damaged at offset %u, dropping %u bytes.", unsigned(pos), unsigned(itsSize-pos));
+		if (truncate(file.c_str(), pos) != 0)
+			Log(llError, "Couldn't truncate cache: %s", strerror(errno));
+		itsSize = pos;
+	}
+	itsAppended = itsSize;
+	
+	itsPosition = std::max(itsAcked, static_cast<long long>(header_size));
+	if (itsPosition >= static_cast<long long>(itsSize))
+		Close();
+	return true;
+}
+
+bool JournalReader::Resume(const string &file, long long position)
+{
+	Close();
+	itsFD = open(file.c_str(), O_RDONLY);
+	struct stat st;
+	if (itsFD < 0 || fstat(itsFD, &st) != 0 || st.st_size <= position || !Map(st.st_size))
+	{
+		Close();
+		return false;
+	}
+	itsPosition = position;
+	// journal may have been rewritten since it was opened
+	itsAppended = std::min(itsAppended, static_cast<long long>(st.st_size));
+	return true;
+}
+
+void JournalReader::Close()
+{
+	if (itsData)
+		munmap(itsData, itsMapped);
+	if (itsFD >= 0)
+		close(itsFD);
+	itsFD = -1;
+	itsData = 0;
+	itsSize = 0;
+	itsMapped = 0;
+}
+
+bool JournalReader::Next(string &record, long long &offset)
+{
+	while (itsData)
+	{
+		// songs added after opening are read too, so remap if needed
+		struct stat st;
+		if (itsPosition + record_header_size > itsSize && (fstat(itsFD, &st) != 0 || size_t(st.st_size) <= itsSize || !Map(st.st_size)))
+			return false;
+		if (itsPosition + record_header_size > itsSize)
+			continue;
+		
+		size_t length = GetUInt32(itsData+itsPosition);
+		if (length > max_record_size)
+		{
+			if (!SkipDamaged(itsPosition))
+				return false;
+			continue;
+		}
+		if (itsPosition + record_header_size + length > itsSize)
+		{
+			if (fstat(itsFD, &st) != 0 || size_t(st.st_size) <= itsSize || !Map(st.st_size))
+				return false;
+			continue;
+		}
+		
+		const char *payload = itsData+itsPosition+record_header_size;
+		long long position = itsPosition;
+		itsPosition += record_header_size + length;
+		
+		if (Crc32c(payload, length) != GetUInt32(itsData+position+4))
+		{
+			if (!SkipDamaged(position))
+				return false;
+			continue;
+		}
+		if (length > 0 && payload[0] == song_record)
+		{
+			record.assign(payload+1, length-1);
+			offset = position;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool JournalReader::SkipDamaged(long long position)
+{
+	isDamaged = 1;
+	if (position >= itsAppended)
+	{
+		Log(llError, "Cache is damaged at offset %lld, not reading it any further.", position);
+		itsPosition = position;
+		return false;
+	}
+	// records behind damaged one can't be trusted to be records, so
+	// reading goes on at the first whole record with valid checksum.
+	// records appended since the journal was opened are whole anyway.
+	long long next = position+1;
+	while (next < itsAppended && !IsRecord(next))
+		next++;
+	Log(llError, "Cache is damaged at offset %lld, skipping %lld bytes.", position, next-position);
+	itsPosition = next;
+	return true;
+}
+
+bool JournalReader::IsRecord(long long position) const
+{
+	long long end = std::min(itsAppended, static_cast<long long>(itsSize));
+	if (position + static_cast<long long>(record_header_size) >= end)
+		return false;
+	size_t length = GetUInt32(itsData+position);
+	if (length == 0 || length > max_record_size || position + record_header_size + length > size_t(end))
+		return false;
+	const char *payload = itsData+position+record_header_size;
+	return (payload[0] == song_record || payload[0] == ack_record) && Crc32c(payload, length) == GetUInt32(itsData+position+4);
+}
+
+bool JournalReader::Map(size_t size)
+{
+	if (itsData)
+		munmap(itsData, itsMapped);
+	void *data = mmap(0, size, PROT_READ, MAP_PRIVATE, itsFD, 0);
+	if (data == MAP_FAILED)
+	{
+		itsData = 0;
+		itsSize = 0;
+		itsMapped = 0;
+		return false;
+	}
+	itsData = static_cast<char *>(data);
+	itsSize = size;
+	itsMapped = size;
+	return true;
+}
+
+long long JournalReplay(const string &file, std::vector<string> &records, std::vector<long long> &offsets)
+{
+	std::ifstream f(file.c_str(), std::ios::binary);
+	if (!f.is_open())
+		return 0;
+	string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+	f.close();
+	
+	if (data.empty())
+		return 0;
+	
+	if (data.length() < header_size || memcmp(data.data(), journal_magic, sizeof(journal_magic)) != 0)
+	{
+		ReadText(file, records);
+		Log(llInfo, "Converting cache to journal format (%u songs).", unsigned(records.size()));
+		if (!JournalRewrite(file, records, offsets))
+			Log(llError, "Couldn't convert cache: %s", strerror(errno));
+		return 0;
+	}
+	
+	unsigned version = GetUInt32(data.data()+sizeof(journal_magic));
+	if (version != journal_version && version != 1)
+	{
+		// new songs can't be appended to it, so it's kept aside for
+		// the version of scrobby that wrote it
+		string aside = file + ".unknown";
+		if (rename(file.c_str(), aside.c_str()) == 0)
+			Log(llError, "Cache has unknown format version %u, moved it to %s.", version, aside.c_str());
+		else
+			Log(llError, "Cache has unknown format version %u and couldn't be moved aside: %s", version, strerror(errno));
+		return 0;
+	}
+	
+	long long acked = 0;
+	size_t pos = header_size;
+	while (pos + record_header_size <= data.length())
+	{
+		size_t length = GetUInt32(data.data()+pos);
+		unsigned crc = GetUInt32(data.data()+pos+4);
+		if (length > max_record_size || pos + record_header_size + length > data.length())
+			break;
+		const char *payload = data.data()+pos+record_header_size;
+		if (Crc32c(payload, length) != crc)
+			break;
+		if (version == 1)
+		{
+			records.push_back(string(payload, length));
+			offsets.push_back(pos);
+		}
+		else if (length > 0 && payload[0] == song_record)
+		{
+			records.push_back(string(payload+1, length-1));
+			offsets.push_back(pos);
+		}
+		else if (length == 9 && payload[0] == ack_record)
+		{
+			acked = GetUInt32(payload+1) | (static_cast<long long>(GetUInt32(payload+5)) << 32);
+			// songs before checkpoint were accepted already
+			size_t i = 0;
+			while (i < offsets.size() && offsets[i] < acked)
+				i++;
+			records.erase(records.begin(), records.begin()+i);
+			offsets.erase(offsets.begin(), offsets.begin()+i);
+		}
+		pos += record_header_size + length;
+	}
+	
+	if (pos < data.length())
+	{
+		Log(llWarning, "Cache is damaged after %u songs, dropping %u bytes.", unsigned(records.size()), unsigned(data.length()-pos));
+		if (truncate(file.c_str(), pos) != 0)
+			Log(llError, "Couldn't truncate cache: %s", strerror(errno));
+	}
+	
+	if (version == 1)
+	{
+		Log(llInfo, "Converting cache to current journal format (%u songs).", unsigned(records.size()));
+		if (!JournalRewrite(file, records, offsets))
+			Log(llError, "Couldn't convert cache: %s", strerror(errno));
+		return 0;
+	}
+	return acked;
+}
@@ -0,0 +1,185 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <string>
+#include <vector>
+
+#include "configuration.h"
+#include "worker.h"
+
+/// cache of songs waiting for submission is kept as append-only journal.
+/// file starts with magic and format version, then each record is
+/// stored as its length and crc32c checksum followed by the data, so
+/// that record torn by a crash is detected and dropped on replay.
+/// records are either songs or checkpoints saying that all songs
+/// before given offset were accepted by the server.
+
+unsigned Crc32c(const char *, size_t);
+
+/// appends records to journal through descriptor kept open. songs are
+/// flushed to disk in groups according to sync policy, checkpoints are
+/// always flushed at once. syncs run in worker thread if there is one,
+/// so that main loop doesn't wait for the disk.
+class JournalWriter
+{
+	typedef void (*AckHandler) (long long, void *);
+	
+	public:
+		JournalWriter();
+		~JournalWriter();
+		
+		void SetPolicy(SyncPolicy, int interval, int records);
+		void SetWorker(Worker *);
+		
+		/// called with offset covered by checkpoint once it's on disk
+		void SetAckHandler(AckHandler, void *);
+		
+		/// fails if file isn't empty and isn't a journal in current format
+		bool Open(const std::string &file);
+		
+		/// records that weren't synced yet are left to the kernel,
+		/// use Flush() first if they matter
+		void Close();
+		
+		/// returns offset of the record or -1 on error
+		long long Append(const std::string &record);
+		
+		/// marks songs before offset (or all songs if it's negative) as
+		/// accepted, returns offset the checkpoint covers or -1 on error.
+		/// checkpoint counts once ack handler is called for it.
+		long long Ack(long long offset);
+		
+		/// starts syncing records written so far
+		void Sync();
+		
+		/// syncs records written so far and waits for it
+		bool Flush();
+		
+		/// offset covered by the last checkpoint written, synced or not
+		long long GetCheckpoint() const { return itsCheckpoint; }
+		
+		/// time (in ms) left until pending songs have to be flushed,
+		/// -1 if there are none
+		int GetTimeout() const;
+		void CheckTimeout();
+		
+	private:
+		struct SyncJob
+		{
+			JournalWriter *Writer;
+			unsigned Generation;
+			int FD;
+			int Records;
+			long long Checkpoint;
+			int Error;
+		};
+		
+		static void RunSync(void *);
+		static void SyncDone(void *);
+		
+		long long Write(char type, const std::string &record);
+		
+		std::string itsFile;
+		int itsFD;
+		long long itsSize;
+		
+		SyncPolicy itsPolicy;
+		int itsInterval;
+		int itsRecords;
+		
+		Worker *itsWorker;
+		AckHandler itsAckHandler;
+		void *itsAckUserdata;
+		
+		// syncs started before the file was reopened don't count
+		unsigned itsGeneration;
+		bool isSyncing;
+		bool itsSyncAgain;
+		
+		long long itsCheckpoint;
+		long long itsSyncedCheckpoint;
+		
+		int itsUnsynced;
+		double itsFirstUnsynced;
+};
+
+/// replaces journal with given records, their offsets are stored in offsets
+bool JournalRewrite(const std::string &file, const std::vector<std::string> &records, std::vector<long long> &offsets);
+
+/// reads journal mapped into memory. records are decoded one by one when
+/// they're needed, so startup doesn't depend on the size of the backlog.
+class JournalReader
+{
+	public:
+		JournalReader();
+		~JournalReader();
+		
+		/// maps journal, finds the last checkpoint and cuts torn record at
+		/// the end of the file. returns false if file isn't a journal in
+		/// current format.
+		bool Open(const std::string &file);
+		void Close();
+		
+		/// maps journal again and continues reading at given offset,
+		/// it has to be start of a record
+		bool Resume(const std::string &file, long long position);
+		
+		/// true while there are records left to read
+		bool IsOpen() const { return itsData != 0; }
+		
+		long long GetAcked() const { return itsAcked; }
+		long long GetPosition() const { return itsPosition; }
+		
+		/// true if records had to be skipped since the journal was opened,
+		/// they stay in the file until it's rewritten
+		bool IsDamaged() const { return isDamaged; }
+		
+		/// checks and decodes next song record, records appended to the
+		/// file since it was mapped are read as well. damaged records are
+		/// skipped up to the next whole one.
+		bool Next(std::string &record, long long &offset);
+		
+	private:
+		bool SkipDamaged(long long position);
+		bool IsRecord(long long position) const;
+		bool Map(size_t size);
+		
+		int itsFD;
+		char *itsData;
+		size_t itsSize;
+		size_t itsMapped;
+		long long itsPosition;
+		long long itsAcked;
+		
+		// records from here on were appended by the writer
+		long long itsAppended;
+		bool isDamaged;
+};
+
+/// reads valid records that weren't accepted yet, stops at first damaged
+/// one and cuts the file there. text caches of older versions are read
+/// and converted, journals of unknown versions are moved aside.
+/// returns offset of the last checkpoint.
+long long JournalReplay(const std::string &file, std::vector<std::string> &records, std::vector<long long> &offsets);
+
+#endif
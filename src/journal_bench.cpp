@@ -0,0 +1,113 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+// measures how fast songs are appended to the journal and read back,
+// by replay like at startup and by reader decoding them one by one.
+// songs are synced once at the end, so that disk speed doesn't count.
+// usage: journal_bench [songs]
+
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "misc.h"
+
+using std::string;
+
+namespace
+{
+	void Report(const char *name, int songs, long long bytes, double elapsed)
+	{
+		printf("%-7s %d songs in %.1f ms: %.0f songs/s, %.1f MB/s\n",
+		       name, songs, elapsed*1000, songs/elapsed, bytes/elapsed/1e6);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int songs = argc > 1 ? atoi(argv[1]) : 1000000;
+	
+	char dir[] = "/tmp/scrobby-bench.XXXXXX";
+	if (!mkdtemp(dir))
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	string file = string(dir) + "/cache";
+	Config.file_log = "/dev/null";
+	Config.log_level = llError;
+	
+	std::vector<string> records;
+	records.reserve(songs);
+	char record[128];
+	for (int i = 0; i < songs; i++)
+	{
+		snprintf(record, sizeof(record), "%d\t200\tArtist %d\tTitle %d\tAlbum\t%d\t", 1200000000+i, i%1000, i, i%12+1);
+		records.push_back(record);
+	}
+	
+	JournalWriter w;
+	w.SetPolicy(spNone, 0, 0);
+	double start = CurrentTime();
+	bool ok = w.Open(file);
+	for (int i = 0; ok && i < songs; i++)
+		ok = w.Append(records[i]) >= 0;
+	ok = ok && w.Flush();
+	w.Close();
+	double elapsed = CurrentTime()-start;
+	struct stat st;
+	if (!ok || stat(file.c_str(), &st) != 0)
+	{
+		fprintf(stderr, "couldn't write journal\n");
+		unlink(file.c_str());
+		rmdir(dir);
+		return 1;
+	}
+	Report("append", songs, st.st_size, elapsed);
+	
+	std::vector<string> replayed;
+	std::vector<long long> offsets;
+	start = CurrentTime();
+	JournalReplay(file, replayed, offsets);
+	elapsed = CurrentTime()-start;
+	Report("replay", replayed.size(), st.st_size, elapsed);
+	
+	JournalReader r;
+	string song;
+	long long offset;
+	int read = 0;
+	start = CurrentTime();
+	r.Open(file);
+	while (r.Next(song, offset))
+		read++;
+	r.Close();
+	elapsed = CurrentTime()-start;
+	Report("reader", read, st.st_size, elapsed);
+	
+	bool same = int(replayed.size()) == songs && read == songs;
+	if (!same)
+		fprintf(stderr, "%d songs written, %zu replayed and %d read\n", songs, replayed.size(), read);
+	
+	unlink(file.c_str());
+	rmdir(dir);
+	return same ? 0 : 1;
+}
@@ -0,0 +1,345 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+// checks that damaged or foreign cache journals are recovered safely
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "worker.h"
+
+using std::string;
+
+namespace
+{
+	int failures = 0;
+	bool failing_sync = false;
+	bool holding_sync = false;
+	int synced_directories = 0;
+	long long acked = -1;
+	
+	void Check(bool ok, const char *what)
+	{
+		if (!ok)
+		{
+			fprintf(stderr, "FAIL: %s\n", what);
+			failures++;
+		}
+	}
+	
+	long long FileSize(const string &file)
+	{
+		struct stat st;
+		return stat(file.c_str(), &st) == 0 ? st.st_size : -1;
+	}
+	
+	void Patch(const string &file, long long offset, const char *data, size_t length)
+	{
+		int fd = open(file.c_str(), O_WRONLY);
+		if (fd < 0 || pwrite(fd, data, length, offset) != ssize_t(length))
+			Check(false, "patching journal");
+		close(fd);
+	}
+	
+	void Acked(long long offset, void *)
+	{
+		acked = offset;
+	}
+	
+	// writes three songs and returns their offsets
+	std::vector<long long> WriteSongs(const string &file)
+	{
+		unlink(file.c_str());
+		std::vector<long long> offsets;
+		JournalWriter w;
+		w.Open(file);
+		offsets.push_back(w.Append("first"));
+		offsets.push_back(w.Append("second"));
+		offsets.push_back(w.Append("third"));
+		w.Close();
+		return offsets;
+	}
+	
+	std::vector<string> ReadSongs(const string &file)
+	{
+		std::vector<string> records;
+		JournalReader r;
+		if (!r.Open(file))
+			return records;
+		string record;
+		long long offset;
+		while (r.Next(record, offset))
+			records.push_back(record);
+		return records;
+	}
+	
+	void CheckDamagedCrc(const string &file)
+	{
+		std::vector<long long> offsets = WriteSongs(file);
+		// flip a byte in the payload of the second song
+		Patch(file, offsets[1]+9, "X", 1);
+		
+		long long size = FileSize(file);
+		
+		// checksums are checked while reading, after the writer has
+		// already appended to the journal
+		JournalReader r;
+		Check(r.Open(file), "reader opens journal with bad crc");
+		JournalWriter w;
+		Check(w.Open(file), "writer opens journal with bad crc");
+		w.Append("fourth");
+		w.Close();
+		std::vector<string> records;
+		string record;
+		long long offset;
+		while (r.Next(record, offset))
+			records.push_back(record);
+		Check(r.IsDamaged(), "reader reports damaged record");
+		Check(records.size() == 3 && records[0] == "first" && records[1] == "third" && records[2] == "fourth", "reader skips record with bad crc");
+		r.Close();
+		Check(FileSize(file) > size, "reader leaves records after bad crc alone");
+		
+		records = ReadSongs(file);
+		Check(records.size() == 3 && records[2] == "fourth", "songs appended after damage are read again");
+		
+		// with damaged length the rest of the file looks like torn tail
+		// and is cut, songs appended after that have to be found
+		offsets = WriteSongs(file);
+		Patch(file, offsets[1], "\x05\0\0\0", 4);
+		records = ReadSongs(file);
+		Check(records.size() == 1 && records[0] == "first", "reader stops at record with small bad length");
+		Check(w.Open(file), "writer opens journal with small bad length");
+		w.Append("fourth");
+		w.Close();
+		records = ReadSongs(file);
+		Check(records.size() == 2 && records[1] == "fourth", "reader finds songs appended after bad length");
+		
+		offsets = WriteSongs(file);
+		Patch(file, offsets[1]+9, "X", 1);
+		std::vector<string> replayed;
+		std::vector<long long> replayed_offsets;
+		JournalReplay(file, replayed, replayed_offsets);
+		Check(replayed.size() == 1 && replayed[0] == "first", "replay stops at record with bad crc");
+		Check(FileSize(file) == offsets[1], "replay cuts journal at record with bad crc");
+	}
+	
+	void CheckDamagedLength(const string &file)
+	{
+		std::vector<long long> offsets = WriteSongs(file);
+		Patch(file, offsets[1], "\xff\xff\xff\x7f", 4);
+		
+		std::vector<string> records = ReadSongs(file);
+		Check(records.size() == 1 && records[0] == "first", "reader stops at record with bad length");
+		Check(FileSize(file) == offsets[1], "reader cuts journal at record with bad length");
+	}
+	
+	void CheckTornTail(const string &file)
+	{
+		std::vector<long long> offsets = WriteSongs(file);
+		Check(truncate(file.c_str(), FileSize(file)-2) == 0, "tearing journal");
+		
+		std::vector<string> records = ReadSongs(file);
+		Check(records.size() == 2, "reader drops torn record");
+		Check(FileSize(file) == offsets[2], "reader cuts torn record");
+		
+		offsets = WriteSongs(file);
+		Check(truncate(file.c_str(), FileSize(file)-2) == 0, "tearing journal");
+		std::vector<long long> replayed_offsets;
+		records.clear();
+		JournalReplay(file, records, replayed_offsets);
+		Check(records.size() == 2, "replay drops torn record");
+		Check(FileSize(file) == offsets[2], "replay cuts torn record");
+	}
+	
+	void CheckCheckpoint(const string &file)
+	{
+		std::vector<long long> offsets = WriteSongs(file);
+		JournalWriter w;
+		w.Open(file);
+		Check(w.Ack(offsets[2]) == offsets[2], "writing checkpoint");
+		w.Close();
+		
+		std::vector<string> records = ReadSongs(file);
+		Check(records.size() == 1 && records[0] == "third", "reader starts after checkpoint");
+		
+		std::vector<string> replayed;
+		std::vector<long long> replayed_offsets;
+		Check(JournalReplay(file, replayed, replayed_offsets) == offsets[2], "replay returns checkpoint");
+		Check(replayed.size() == 1 && replayed[0] == "third", "replay drops accepted songs");
+	}
+	
+	void CheckFailedSync(const string &file)
+	{
+		std::vector<long long> offsets = WriteSongs(file);
+		JournalWriter w;
+		w.SetPolicy(spInterval, 60, 100);
+		w.SetAckHandler(Acked, 0);
+		w.Open(file);
+		w.Append("fourth");
+		acked = -1;
+		
+		failing_sync = true;
+		w.Sync();
+		Check(w.GetTimeout() > 0, "songs stay pending after failed sync");
+		Check(w.Ack(offsets[1]) == offsets[1], "writing checkpoint");
+		Check(acked < 0, "checkpoint doesn't count after failed sync");
+		Check(!w.Flush(), "flush reports failure");
+		
+		failing_sync = false;
+		Check(w.Flush(), "flush succeeds again");
+		Check(w.GetTimeout() < 0, "nothing is pending after sync");
+		Check(acked == offsets[1], "checkpoint counts after sync");
+		w.Close();
+	}
+	
+	void CheckWorkerSync(const string &file)
+	{
+		std::vector<long long> offsets = WriteSongs(file);
+		Worker worker;
+		if (!worker.Start())
+		{
+			Check(false, "starting worker");
+			return;
+		}
+		JournalWriter w;
+		w.SetPolicy(spAlways, 60, 100);
+		w.SetWorker(&worker);
+		w.SetAckHandler(Acked, 0);
+		w.Open(file);
+		acked = -1;
+		
+		// writer goes on while disk is stuck, if it waited for it
+		// the alarm would kill the check
+		__atomic_store_n(&holding_sync, true, __ATOMIC_RELEASE);
+		alarm(10);
+		w.Append("fourth");
+		w.Append("fifth");
+		Check(w.Ack(offsets[2]) == offsets[2], "checkpoint is written while sync is running");
+		Check(acked < 0, "checkpoint doesn't count before it's synced");
+		
+		__atomic_store_n(&holding_sync, false, __ATOMIC_RELEASE);
+		worker.Wait();
+		alarm(0);
+		Check(acked == offsets[2], "checkpoint counts once it's synced");
+		Check(w.GetTimeout() < 0, "nothing is pending after syncs are done");
+		w.Close();
+		
+		std::vector<string> records;
+		std::vector<long long> replayed_offsets;
+		JournalReplay(file, records, replayed_offsets);
+		Check(records.size() == 3 && records[2] == "fifth", "songs written during sync are read back");
+	}
+	
+	void CheckRewrite(const string &file)
+	{
+		std::vector<string> records;
+		records.push_back("first");
+		records.push_back("second");
+		std::vector<long long> offsets;
+		synced_directories = 0;
+		Check(JournalRewrite(file, records, offsets), "rewriting journal");
+		Check(synced_directories == 1, "rewrite syncs directory after rename");
+		
+		std::vector<string> replayed;
+		std::vector<long long> replayed_offsets;
+		JournalReplay(file, replayed, replayed_offsets);
+		Check(replayed == records && replayed_offsets == offsets, "rewritten journal is read back");
+	}
+	
+	void CheckUnknownVersion(const string &file)
+	{
+		WriteSongs(file);
+		Patch(file, 4, "\x63\0\0\0", 4);
+		long long size = FileSize(file);
+		
+		JournalReader r;
+		Check(!r.Open(file), "reader refuses unknown version");
+		r.Close();
+		
+		JournalWriter w;
+		Check(!w.Open(file), "writer refuses unknown version");
+		Check(FileSize(file) == size, "writer leaves unknown version alone");
+		
+		std::vector<string> records;
+		std::vector<long long> offsets;
+		JournalReplay(file, records, offsets);
+		Check(records.empty(), "replay ignores unknown version");
+		Check(FileSize(file) < 0, "replay moves unknown version away");
+		Check(FileSize(file + ".unknown") == size, "unknown version is kept aside");
+		unlink((file + ".unknown").c_str());
+	}
+}
+
+// journal code calls these ones, so that failing disk can be simulated
+// and syncs of directories counted
+extern "C" int fdatasync(int fd)
+{
+	while (__atomic_load_n(&holding_sync, __ATOMIC_ACQUIRE))
+		usleep(1000);
+	if (failing_sync)
+	{
+		errno = EIO;
+		return -1;
+	}
+	return syscall(SYS_fdatasync, fd);
+}
+
+extern "C" int fsync(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISDIR(st.st_mode))
+		synced_directories++;
+	return syscall(SYS_fsync, fd);
+}
+
+int main()
+{
+	char dir[] = "/tmp/scrobby-check.XXXXXX";
+	if (!mkdtemp(dir))
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	string file = string(dir) + "/cache";
+	Config.file_log = string(dir) + "/log";
+	Config.log_level = llVerbose;
+	
+	CheckDamagedCrc(file);
+	CheckDamagedLength(file);
+	CheckTornTail(file);
+	CheckCheckpoint(file);
+	CheckFailedSync(file);
+	CheckWorkerSync(file);
+	CheckRewrite(file);
+	CheckUnknownVersion(file);
+	
+	unlink(file.c_str());
+	unlink((file + ".tmp").c_str());
+	unlink(Config.file_log.c_str());
+	rmdir(dir);
+	return failures ? 1 : 0;
+}
+
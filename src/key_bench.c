@@ -0,0 +1,147 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+// measures how many lines of recorded status and currentsong responses
+// get their keys looked up per second, with the chain of strcmp calls
+// libmpdclient used before and with its switch on length and first
+// character. libmpdclient is included, so that its static lookups can
+// be called directly.
+// usage: key_bench [iterations]
+
+#include <time.h>
+
+#include "libmpdclient.c"
+
+static const char *status_keys[] = {
+	"volume", "repeat", "random", "single", "consume", "playlist",
+	"playlistlength", "xfade", "state", "song", "songid", "time",
+	"bitrate", "audio", "nextsong", "nextsongid"
+};
+
+static const char *song_keys[] = {
+	"file", "Time", "Artist", "Title", "Album", "Track", "Date", "Genre",
+	"Disc", "MUSICBRAINZ_TRACKID", "Pos", "Id"
+};
+
+#define COUNT(a)	(sizeof(a)/sizeof(a[0]))
+
+/* lookups as mpd_getStatusInto and mpd_getNextInfoEntity did them */
+static int chain_statusKey(const char * name) {
+	if(strcmp(name,"volume")==0) return MPD_STATUS_KEY_VOLUME;
+	else if(strcmp(name,"repeat")==0) return MPD_STATUS_KEY_REPEAT;
+	else if(strcmp(name,"random")==0) return MPD_STATUS_KEY_RANDOM;
+	else if(strcmp(name,"playlist")==0) return MPD_STATUS_KEY_PLAYLIST;
+	else if(strcmp(name,"playlistlength")==0) return MPD_STATUS_KEY_PLAYLISTLENGTH;
+	else if(strcmp(name,"bitrate")==0) return MPD_STATUS_KEY_BITRATE;
+	else if(strcmp(name,"state")==0) return MPD_STATUS_KEY_STATE;
+	else if(strcmp(name,"song")==0) return MPD_STATUS_KEY_SONG;
+	else if(strcmp(name,"songid")==0) return MPD_STATUS_KEY_SONGID;
+	else if(strcmp(name,"time")==0) return MPD_STATUS_KEY_TIME;
+	else if(strcmp(name,"error")==0) return MPD_STATUS_KEY_ERROR;
+	else if(strcmp(name,"xfade")==0) return MPD_STATUS_KEY_XFADE;
+	else if(strcmp(name,"updating_db")==0) return MPD_STATUS_KEY_UPDATING_DB;
+	else if(strcmp(name,"audio")==0) return MPD_STATUS_KEY_AUDIO;
+	return MPD_STATUS_KEY_UNKNOWN;
+}
+
+static int chain_infoKey(const char * name) {
+	if(strcmp(name,"file")==0) return MPD_INFO_KEY_FILE;
+	else if(strcmp(name,"directory")==0) return MPD_INFO_KEY_DIRECTORY;
+	else if(strcmp(name,"playlist")==0) return MPD_INFO_KEY_PLAYLIST;
+	else if(strcmp(name,"cpos")==0) return MPD_INFO_KEY_CPOS;
+	else if(strcmp(name,"Artist")==0) return MPD_INFO_KEY_ARTIST;
+	else if(strcmp(name,"Album")==0) return MPD_INFO_KEY_ALBUM;
+	else if(strcmp(name,"Title")==0) return MPD_INFO_KEY_TITLE;
+	else if(strcmp(name,"Track")==0) return MPD_INFO_KEY_TRACK;
+	else if(strcmp(name,"Name")==0) return MPD_INFO_KEY_NAME;
+	else if(strcmp(name,"Time")==0) return MPD_INFO_KEY_TIME;
+	else if(strcmp(name,"Pos")==0) return MPD_INFO_KEY_POS;
+	else if(strcmp(name,"Id")==0) return MPD_INFO_KEY_ID;
+	else if(strcmp(name,"Date")==0) return MPD_INFO_KEY_DATE;
+	else if(strcmp(name,"Genre")==0) return MPD_INFO_KEY_GENRE;
+	else if(strcmp(name,"Composer")==0) return MPD_INFO_KEY_COMPOSER;
+	else if(strcmp(name,"Performer")==0) return MPD_INFO_KEY_PERFORMER;
+	else if(strcmp(name,"Disc")==0) return MPD_INFO_KEY_DISC;
+	else if(strcmp(name,"Comment")==0) return MPD_INFO_KEY_COMMENT;
+	else if(strcmp(name,"MUSICBRAINZ_TRACKID")==0) return MPD_INFO_KEY_MUSICBRAINZ_TRACKID;
+	return MPD_INFO_KEY_UNKNOWN;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* keys are copied out of the tables, so that the compiler can't see
+ * what they are, like it can't with the ones read from mpd */
+static char names[COUNT(status_keys)+COUNT(song_keys)][32];
+static volatile int sink;
+
+static double run(int (*status)(const char *), int (*info)(const char *), int iterations) {
+	double start = now();
+	int i, j, sum = 0;
+
+	for(i = 0; i < iterations; i++) {
+		for(j = 0; j < (int)COUNT(status_keys); j++)
+			sum += status(names[j]);
+		for(; j < (int)COUNT(names); j++)
+			sum += info(names[j]);
+	}
+	sink = sum;
+	return now()-start;
+}
+
+static int switch_statusKey(const char * name) {
+	return mpd_statusKey(name);
+}
+
+static int switch_infoKey(const char * name) {
+	return mpd_infoKey(name);
+}
+
+int main(int argc, char **argv) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+	double lines = (double)iterations*COUNT(names);
+	double chain, dispatch;
+	size_t i;
+
+	for(i = 0; i < COUNT(status_keys); i++)
+		strcpy(names[i], status_keys[i]);
+	for(i = 0; i < COUNT(song_keys); i++)
+		strcpy(names[COUNT(status_keys)+i], song_keys[i]);
+
+	/* both have to find the same keys, or the numbers mean nothing */
+	for(i = 0; i < COUNT(names); i++) {
+		int same = i < COUNT(status_keys)
+			? chain_statusKey(names[i]) == switch_statusKey(names[i])
+			: chain_infoKey(names[i]) == switch_infoKey(names[i]);
+		if(!same) {
+			fprintf(stderr, "lookups differ for %s\n", names[i]);
+			return 1;
+		}
+	}
+
+	chain = run(chain_statusKey, chain_infoKey, iterations);
+	dispatch = run(switch_statusKey, switch_infoKey, iterations);
+	printf("%.0f lines: strcmp chain %.1f M lines/s, switch %.1f M lines/s\n",
+			lines, lines/chain/1e6, lines/dispatch/1e6);
+	return 0;
+}
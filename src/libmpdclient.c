@@ -30,6 +30,10 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
 #include "libmpdclient.h"
 
 #include <errno.h>
@@ -42,6 +46,8 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
+#include <sys/time.h>
 
 #ifdef WIN32
 #  include <ws2tcpip.h>
@@ -51,6 +57,7 @@
 #  include <arpa/inet.h>
 #  include <sys/socket.h>
 #  include <netdb.h>
+#  include <poll.h>
 #endif
 
 /* (bits+1)/3 (plus the sign character) */
@@ -66,6 +73,12 @@
 #  endif
 #endif
 
+#if defined(MPD_HAVE_GAI) && defined(HAVE_PTHREAD_H)
+#  define MPD_HAVE_THREADS
+#  include <pthread.h>
+#  include <signal.h>
+#endif
+
 #ifndef WIN32
 #include <sys/un.h>
 #endif
@@ -77,9 +90,11 @@
 #ifdef WIN32
 #  define SELECT_ERRNO_IGNORE   (errno == WSAEINTR || errno == WSAEINPROGRESS)
 #  define SENDRECV_ERRNO_IGNORE SELECT_ERRNO_IGNORE
+#  define CONNECT_IN_PROGRESS   (WSAGetLastError() == WSAEWOULDBLOCK)
 #else
 #  define SELECT_ERRNO_IGNORE   (errno == EINTR)
 #  define SENDRECV_ERRNO_IGNORE (errno == EINTR || errno == EAGAIN)
+#  define CONNECT_IN_PROGRESS   (errno == EINPROGRESS)
 #  define winsock_dll_error(c)  0
 #  define closesocket(s)        close(s)
 #  define WSACleanup()          do { /* nothing */ } while (0)
@@ -100,105 +115,433 @@ static int winsock_dll_error(mpd_Connection *connection)
 	return 0;
 }
 
-static int do_connect_fail(mpd_Connection *connection,
-                           const struct sockaddr *serv_addr, int addrlen)
+static void set_nonblocking(int sock)
 {
 	int iMode = 1; /* 0 = blocking, else non-blocking */
-	if (connect(connection->sock, serv_addr, addrlen) == SOCKET_ERROR)
-		return 1;
-	ioctlsocket(connection->sock, FIONBIO, (u_long FAR*) &iMode);
-	return 0;
+	ioctlsocket(sock, FIONBIO, (u_long FAR*) &iMode);
 }
 #else /* !WIN32 (sane operating systems) */
+static void set_nonblocking(int sock)
+{
+	int flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+#endif /* !WIN32 */
+
+/* maximum number of sockets mpd_waitSockets can wait for */
+#define MPD_WAIT_MAX_SOCKETS MPD_CONNECT_MAX_SOCKETS
+
+/* waits up to msecs ms until some of n sockets (negative ones are
+ * skipped) is ready for reading, or for writing if write is set;
+ * ready[i] is set to 1 for those that are; returns their count, 0 on
+ * timeout or -1 on error
+ * select() is used only on windows, elsewhere it can't handle
+ * descriptors that don't fit in FD_SETSIZE */
+static int mpd_waitSockets(const int * socks, int * ready, int n, int write,
+                           long msecs)
+{
+	int i, ret;
+#ifdef WIN32
+	struct timeval tv;
+	fd_set fds, efds;
+	int maxfd = -1;
+
+	FD_ZERO(&fds);
+	FD_ZERO(&efds);
+	for (i = 0; i < n; i++) {
+		if (socks[i] < 0)
+			continue;
+		FD_SET(socks[i], &fds);
+		FD_SET(socks[i], &efds);
+		if (socks[i] > maxfd)
+			maxfd = socks[i];
+	}
+	tv.tv_sec = msecs / 1000;
+	tv.tv_usec = (msecs % 1000) * 1000;
+	ret = write ? select(maxfd+1, NULL, &fds, &efds, &tv)
+	            : select(maxfd+1, &fds, NULL, &efds, &tv);
+	for (i = 0; i < n; i++) {
+		ready[i] = ret > 0 && socks[i] >= 0 &&
+		           (FD_ISSET(socks[i], &fds) || FD_ISSET(socks[i], &efds));
+	}
+#else
+	struct pollfd pfds[MPD_WAIT_MAX_SOCKETS];
+
+	for (i = 0; i < n; i++) {
+		pfds[i].fd = socks[i];
+		pfds[i].events = write ? POLLOUT : POLLIN;
+		pfds[i].revents = 0;
+	}
+	ret = poll(pfds, n, msecs);
+	for (i = 0; i < n; i++)
+		ready[i] = ret > 0 && pfds[i].revents != 0;
+#endif
+	return ret;
+}
+
+/* waits for the socket of connection with its timeout */
+static int mpd_waitConnection(mpd_Connection * connection, int write) {
+	int ready;
+
+	return mpd_waitSockets(&connection->sock, &ready, 1, write,
+	                       connection->timeout.tv_sec * 1000 +
+	                       connection->timeout.tv_usec / 1000);
+}
+
+#ifndef MPD_HAVE_GAI
 static int do_connect_fail(mpd_Connection *connection,
                            const struct sockaddr *serv_addr, int addrlen)
 {
-	int flags;
 	if (connect(connection->sock, serv_addr, addrlen) < 0)
 		return 1;
-	flags = fcntl(connection->sock, F_GETFL, 0);
-	fcntl(connection->sock, F_SETFL, flags | O_NONBLOCK);
+	set_nonblocking(connection->sock);
 	return 0;
 }
-#endif /* !WIN32 */
+#endif /* !MPD_HAVE_GAI */
+
+static long mpd_msecsSince(const struct timeval * start) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_usec - start->tv_usec) / 1000;
+}
+
+/* phases of connection being established by mpd_continueConnection */
+#define MPD_PHASE_RESOLVE 0
+#define MPD_PHASE_CONNECT 1
+#define MPD_PHASE_WELCOME 2
 
 #ifdef MPD_HAVE_GAI
-static int mpd_connect(mpd_Connection * connection, const char * host, int port,
-                       float timeout)
-{
+/* maximum number of addresses that are tried */
+#define MPD_CONNECT_MAX_ATTEMPTS MPD_CONNECT_MAX_SOCKETS
+/* delay in ms before next address is tried if previous one didn't
+ * answer yet (see RFC 6555) */
+#define MPD_CONNECT_ATTEMPT_DELAY 250
+
+#ifdef MPD_HAVE_THREADS
+/* host names are resolved in a separate thread, so that slow or dead
+ * dns server doesn't block the caller. the thread closes write end of
+ * the pipe when it's done, which makes the read end readable. both
+ * sides hold a reference, the last one to let go frees it */
+struct _mpd_Resolver {
+	pthread_mutex_t lock;
+	int refs;
+	int done;
 	int error;
+	struct addrinfo * addrinfo;
+	char * host;
 	char service[INTLEN+1];
+	int pipe[2];
+};
+#endif /* MPD_HAVE_THREADS */
+
+struct _mpd_Connector {
+	char * host;
+	int port;
+	int phase;
+	struct timeval begin;
+	long total;
+#ifdef MPD_HAVE_THREADS
+	struct _mpd_Resolver * resolver;
+#endif
+	struct addrinfo * addrinfo;
+	struct addrinfo * order[MPD_CONNECT_MAX_ATTEMPTS];
+	int socks[MPD_CONNECT_MAX_ATTEMPTS];
+	struct timeval started[MPD_CONNECT_MAX_ATTEMPTS];
+	/* addresses in order, attempts started so far and still pending */
+	int n, next, active;
+	/* when the last attempt was started (ms since begin) */
+	long last;
+};
+
+static int mpd_resolve(const char * host, const char * service, int flags,
+                       struct addrinfo ** addrinfo)
+{
 	struct addrinfo hints;
-	struct addrinfo *res = NULL;
-	struct addrinfo *addrinfo = NULL;
 
-	/**
-	 * Setup hints
-	 */
-	hints.ai_flags     = AI_ADDRCONFIG;
-	hints.ai_family    = AF_UNSPEC;
-	hints.ai_socktype  = SOCK_STREAM;
-	hints.ai_protocol  = IPPROTO_TCP;
-	hints.ai_addrlen   = 0;
-	hints.ai_addr      = NULL;
-	hints.ai_canonname = NULL;
-	hints.ai_next      = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags    = AI_ADDRCONFIG | flags;
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
 
-	snprintf(service, sizeof(service), "%i", port);
+	return getaddrinfo(host, service, &hints, addrinfo);
+}
+
+#ifdef MPD_HAVE_THREADS
+static void mpd_releaseResolver(struct _mpd_Resolver * resolver) {
+	int refs;
+
+	pthread_mutex_lock(&resolver->lock);
+	refs = --resolver->refs;
+	pthread_mutex_unlock(&resolver->lock);
+	if (refs)
+		return;
 
-	error = getaddrinfo(host, service, &hints, &addrinfo);
+	if (resolver->addrinfo)
+		freeaddrinfo(resolver->addrinfo);
+	pthread_mutex_destroy(&resolver->lock);
+	free(resolver->host);
+	free(resolver);
+}
+
+static void * mpd_runResolver(void * data) {
+	struct _mpd_Resolver * resolver = data;
+	struct addrinfo * addrinfo = NULL;
+	int error;
+
+	error = mpd_resolve(resolver->host, resolver->service, 0, &addrinfo);
+
+	pthread_mutex_lock(&resolver->lock);
+	resolver->error = error;
+	resolver->addrinfo = addrinfo;
+	resolver->done = 1;
+	pthread_mutex_unlock(&resolver->lock);
+
+	close(resolver->pipe[1]);
+	mpd_releaseResolver(resolver);
+	return NULL;
+}
+
+/* returns NULL if the thread couldn't be started */
+static struct _mpd_Resolver * mpd_startResolver(const char * host,
+                                                const char * service)
+{
+	struct _mpd_Resolver * resolver;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	int err;
+
+	resolver = malloc(sizeof(struct _mpd_Resolver));
+	if (!resolver)
+		return NULL;
+	if (pipe(resolver->pipe) < 0) {
+		free(resolver);
+		return NULL;
+	}
+	pthread_mutex_init(&resolver->lock, NULL);
+	resolver->refs = 2;
+	resolver->done = 0;
+	resolver->error = 0;
+	resolver->addrinfo = NULL;
+	resolver->host = strdup(host);
+	strcpy(resolver->service, service);
+
+	/* signals have to be handled by the caller's thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, mpd_runResolver, resolver);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err) {
+		close(resolver->pipe[0]);
+		close(resolver->pipe[1]);
+		pthread_mutex_destroy(&resolver->lock);
+		free(resolver->host);
+		free(resolver);
+		return NULL;
+	}
+	return resolver;
+}
+
+/* takes the result if resolver is done, returns 1 then and 0 otherwise */
+static int mpd_resolverDone(struct _mpd_Resolver * resolver, int * error,
+                            struct addrinfo ** addrinfo)
+{
+	int done;
+
+	pthread_mutex_lock(&resolver->lock);
+	done = resolver->done;
+	if (done) {
+		*error = resolver->error;
+		*addrinfo = resolver->addrinfo;
+		resolver->addrinfo = NULL;
+	}
+	pthread_mutex_unlock(&resolver->lock);
+	return done;
+}
+
+/* the thread may still be running, it cleans up after itself then */
+static void mpd_cancelResolver(struct _mpd_Resolver * resolver) {
+	close(resolver->pipe[0]);
+	mpd_releaseResolver(resolver);
+}
+#endif /* MPD_HAVE_THREADS */
+
+/* appends "address: reason (time)" of failed attempt to errorStr */
+static void mpd_logAttempt(mpd_Connection * connection,
+                           const struct addrinfo * ai, int err,
+                           const struct timeval * start)
+{
+	char addr[NI_MAXHOST];
+	size_t len = strlen(connection->errorStr);
+
+	if (getnameinfo(ai->ai_addr, ai->ai_addrlen, addr, sizeof(addr),
+	                NULL, 0, NI_NUMERICHOST))
+		strcpy(addr, "?");
+	snprintf(connection->errorStr + len, MPD_ERRORSTR_MAX_LENGTH - len,
+	         "%s%s: %s (%ld ms)", len ? "; " : "", addr,
+	         strerror(err), mpd_msecsSince(start));
+}
+
+/* takes result of name resolution and orders the addresses so that
+ * address families alternate, starting with the preferred one */
+static int mpd_resolved(mpd_Connection * connection, int error) {
+	struct _mpd_Connector * c = connection->connector;
+	struct addrinfo * res;
+	int family, i;
 
 	if (error) {
 		snprintf(connection->errorStr, MPD_ERRORSTR_MAX_LENGTH,
 		         "host \"%s\" not found: %s",
-		         host, gai_strerror(error));
+		         c->host, gai_strerror(error));
 		connection->error = MPD_ERROR_UNKHOST;
 		return -1;
 	}
 
-	for (res = addrinfo; res; res = res->ai_next) {
-		/* create socket */
-		if (connection->sock >= 0)
-			closesocket(connection->sock);
-		connection->sock = socket(res->ai_family, SOCK_STREAM,
-		                          res->ai_protocol);
-		if (connection->sock < 0) {
-			snprintf(connection->errorStr, MPD_ERRORSTR_MAX_LENGTH,
-			         "problems creating socket: %s",
-			         strerror(errno));
-			connection->error = MPD_ERROR_SYSTEM;
-			freeaddrinfo(addrinfo);
-			return -1;
+	family = c->addrinfo->ai_family;
+	while (c->n < MPD_CONNECT_MAX_ATTEMPTS) {
+		struct addrinfo *pick = NULL;
+		for (res = c->addrinfo; res; res = res->ai_next) {
+			for (i = 0; i < c->n && c->order[i] != res; i++);
+			if (i < c->n)
+				continue;
+			if (!pick || res->ai_family == family)
+				pick = res;
+			if (pick->ai_family == family)
+				break;
 		}
+		if (!pick)
+			break;
+		c->order[c->n++] = pick;
+		family = pick->ai_family == AF_INET6 ? AF_INET : AF_INET6;
+	}
+
+	c->phase = MPD_PHASE_CONNECT;
+	connection->errorStr[0] = '\0';
+	return 0;
+}
 
-		mpd_setConnectionTimeout(connection, timeout);
+/* starts connecting to the next address, returns 1 if it connected
+ * right away */
+static int mpd_startAttempt(mpd_Connection * connection) {
+	struct _mpd_Connector * c = connection->connector;
+	struct addrinfo * res = c->order[c->next];
+	int sock;
 
-		/* connect stuff */
- 		if (do_connect_fail(connection,
-		                    res->ai_addr, res->ai_addrlen)) {
- 			/* try the next address */
- 			closesocket(connection->sock);
- 			connection->sock = -1;
- 			continue;
+	gettimeofday(&c->started[c->next], NULL);
+	c->last = mpd_msecsSince(&c->begin);
+	sock = socket(res->ai_family, SOCK_STREAM, res->ai_protocol);
+	if (sock < 0) {
+		mpd_logAttempt(connection, res, errno, &c->started[c->next]);
+	}
+	else {
+		set_nonblocking(sock);
+		if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) {
+			connection->sock = sock;
+			c->next++;
+			return 1;
+		}
+		else if (CONNECT_IN_PROGRESS) {
+			c->socks[c->next] = sock;
+			c->active++;
 		}
+		else {
+			mpd_logAttempt(connection, res, errno,
+			               &c->started[c->next]);
+			closesocket(sock);
+		}
+	}
+	c->next++;
+	return 0;
+}
 
-		break;
+/* checks pending attempts without waiting, returns 1 if one of them
+ * has connected */
+static int mpd_checkAttempts(mpd_Connection * connection) {
+	struct _mpd_Connector * c = connection->connector;
+	int ready[MPD_CONNECT_MAX_ATTEMPTS];
+	int i;
+
+	if (!c->active || mpd_waitSockets(c->socks, ready, c->next, 1, 0) <= 0)
+		return 0;
+
+	for (i = 0; i < c->next; i++) {
+		int err = 0;
+		socklen_t errlen = sizeof(err);
+
+		if (c->socks[i] < 0 || !ready[i])
+			continue;
+		if (getsockopt(c->socks[i], SOL_SOCKET, SO_ERROR,
+		               (char *)&err, &errlen) < 0)
+			err = errno;
+		if (!err) {
+			connection->sock = c->socks[i];
+			c->socks[i] = -1;
+			c->active--;
+			return 1;
+		}
+		mpd_logAttempt(connection, c->order[i], err, &c->started[i]);
+		closesocket(c->socks[i]);
+		c->socks[i] = -1;
+		c->active--;
 	}
+	return 0;
+}
 
-	freeaddrinfo(addrinfo);
+/* races the addresses, starting a new attempt every
+ * MPD_CONNECT_ATTEMPT_DELAY ms (or right away if previous ones have
+ * failed already), so that a dead address doesn't block the others;
+ * the first connection that succeeds wins. returns 1 if connected,
+ * 0 if still in progress and -1 on error */
+static int mpd_stepConnect(mpd_Connection * connection) {
+	struct _mpd_Connector * c = connection->connector;
+	int i;
 
-	if (connection->sock < 0) {
+	if (mpd_checkAttempts(connection))
+		return 1;
+
+	while (c->next < c->n && (!c->active ||
+	       mpd_msecsSince(&c->begin) - c->last >= MPD_CONNECT_ATTEMPT_DELAY)) {
+		if (mpd_startAttempt(connection))
+			return 1;
+	}
+
+	if (c->active && mpd_msecsSince(&c->begin) >= c->total) {
+		for (i = 0; i < c->next; i++) {
+			if (c->socks[i] >= 0)
+				mpd_logAttempt(connection, c->order[i],
+				               ETIMEDOUT, &c->started[i]);
+		}
+	}
+	else if (c->active || c->next < c->n)
+		return 0;
+
+	{
+		char attempts[MPD_ERRORSTR_MAX_LENGTH+1];
+
+		strcpy(attempts, connection->errorStr);
 		snprintf(connection->errorStr, MPD_ERRORSTR_MAX_LENGTH,
 		         "problems connecting to \"%s\" on port %i: %s",
-		         host, port, strerror(errno));
+		         c->host, c->port, attempts);
 		connection->error = MPD_ERROR_CONNPORT;
-
-		return -1;
 	}
-
-	return 0;
+	return -1;
 }
 #else /* !MPD_HAVE_GAI */
+struct _mpd_Connector {
+	char * host;
+	int port;
+	int phase;
+	struct timeval begin;
+	long total;
+};
+
 static int mpd_connect(mpd_Connection * connection, const char * host, int port,
                        float timeout)
 {
@@ -295,22 +638,17 @@ static char * mpd_sanitizeArg(const char * arg) {
 	return ret;
 }
 
-static mpd_ReturnElement * mpd_newReturnElement(const char * name, const char * value)
+static mpd_ReturnElement * mpd_newReturnElement(mpd_Connection * connection,
+                                                char * name, char * value)
 {
-	mpd_ReturnElement * ret = malloc(sizeof(mpd_ReturnElement));
+	mpd_ReturnElement * ret = &connection->element;
 
-	ret->name = strdup(name);
-	ret->value = strdup(value);
+	ret->name = name;
+	ret->value = value;
 
 	return ret;
 }
 
-static void mpd_freeReturnElement(mpd_ReturnElement * re) {
-	free(re->name);
-	free(re->value);
-	free(re);
-}
-
 void mpd_setConnectionTimeout(mpd_Connection * connection, float timeout) {
 	connection->timeout.tv_sec = (int)timeout;
 	connection->timeout.tv_usec = (int)(timeout*1e6 -
@@ -384,11 +722,10 @@ static int mpd_connect_un(mpd_Connection * connection,
 
 	error = connect(connection->sock, (struct sockaddr*)&sun, sizeof(sun));
 	if (error < 0) {
-		/* try the next address family */
 		close(connection->sock);
-		connection->sock = 0;
+		connection->sock = -1;
 
-		snprintf(connection->errorStr,MPD_BUFFER_MAX_LENGTH,
+		snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
 			 "problems connecting to \"%s\": %s",
 			 host, strerror(errno));
 		connection->error = MPD_ERROR_CONNPORT;
@@ -399,17 +736,141 @@ static int mpd_connect_un(mpd_Connection * connection,
 }
 #endif /* WIN32 */
 
-mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
-	int err;
-	char * rt;
-	char * output =  NULL;
+void mpd_setBufferLimit(mpd_Connection * connection, int size) {
+	connection->maxBufsize = size > connection->bufsize ?
+	                         size : connection->bufsize;
+}
+
+static int mpd_growBuffer(mpd_Connection * connection) {
+	int size = connection->bufsize*2;
+	int wrapped, fit;
+	char * buffer;
+
+	if(size > connection->maxBufsize) size = connection->maxBufsize;
+	if(size <= connection->bufsize) return -1;
+	if(!(buffer = realloc(connection->buffer, size))) return -1;
+
+	/* append part that wrapped around to the end of old space */
+	wrapped = connection->bufstart+connection->buflen-connection->bufsize;
+	fit = size-connection->bufsize;
+	if(wrapped > fit) {
+		memcpy(buffer+connection->bufsize, buffer, fit);
+		memmove(buffer, buffer+fit, wrapped-fit);
+	}
+	else if(wrapped > 0) {
+		memcpy(buffer+connection->bufsize, buffer, wrapped);
+	}
+
+	connection->buffer = buffer;
+	connection->bufsize = size;
+	return 0;
+}
+
+/* reads into free space of the buffer, growing it first if it's full,
+ * returns what recv returned or -1 with connection->error set if the
+ * buffer can't grow anymore */
+static int mpd_recvBuffer(mpd_Connection * connection, int flags) {
+	int end, room, readed;
+
+	if(connection->buflen>=connection->bufsize &&
+			mpd_growBuffer(connection) < 0) {
+		strcpy(connection->errorStr,"buffer overrun");
+		connection->error = MPD_ERROR_BUFFEROVERRUN;
+		connection->doneProcessing = 1;
+		connection->doneListOk = 0;
+		return -1;
+	}
+
+	end = connection->bufstart+connection->buflen;
+	if(end < connection->bufsize) {
+		room = connection->bufsize-end;
+	}
+	else {
+		end -= connection->bufsize;
+		room = connection->bufstart-end;
+	}
+
+	readed = recv(connection->sock,connection->buffer+end,room,flags);
+	if(readed>0) connection->buflen+=readed;
+	return readed;
+}
+
+/* returns next complete line of response (without newline) or NULL if
+ * there isn't any yet. the line stays valid until the next call */
+static char * mpd_nextLine(mpd_Connection * connection) {
+	char * nl;
+	int first, len;
+
+	if(connection->linelen) {
+		connection->bufstart = (connection->bufstart+connection->linelen)
+		                       % connection->bufsize;
+		connection->buflen -= connection->linelen;
+		connection->respLine -= connection->linelen;
+		if(connection->respLine < 0) connection->respLine = 0;
+		connection->respScanned -= connection->linelen;
+		if(connection->respScanned < 0) connection->respScanned = 0;
+		connection->linelen = 0;
+		connection->scanned = 0;
+	}
+	/* keep free space in one piece as long as possible */
+	if(!connection->buflen) connection->bufstart = 0;
+
+	first = connection->bufsize-connection->bufstart;
+	if(first > connection->buflen) first = connection->buflen;
+
+	if(connection->scanned < first) {
+		nl = memchr(connection->buffer+connection->bufstart+
+		            connection->scanned, '\n',
+		            first-connection->scanned);
+		if(nl) {
+			*nl = '\0';
+			connection->linelen = nl-connection->buffer-
+			                      connection->bufstart+1;
+			return connection->buffer+connection->bufstart;
+		}
+		connection->scanned = first;
+	}
+
+	if(connection->scanned < connection->buflen) {
+		nl = memchr(connection->buffer+connection->scanned-first, '\n',
+		            connection->buflen-connection->scanned);
+		if(nl) {
+			len = first+(nl-connection->buffer);
+			if(len >= connection->linesize) {
+				free(connection->line);
+				connection->linesize = len+1;
+				connection->line = malloc(connection->linesize);
+			}
+			memcpy(connection->line,
+			       connection->buffer+connection->bufstart, first);
+			memcpy(connection->line+first, connection->buffer,
+			       len-first);
+			connection->line[len] = '\0';
+			connection->linelen = len+1;
+			return connection->line;
+		}
+		connection->scanned = connection->buflen;
+	}
+
+	return NULL;
+}
+
+static mpd_Connection * mpd_allocConnection(void) {
 	mpd_Connection * connection = malloc(sizeof(mpd_Connection));
-	struct timeval tv;
-	fd_set fds;
-	strcpy(connection->buffer,"");
 	connection->sock = -1;
+	connection->buffer = malloc(MPD_BUFFER_INITIAL_LENGTH);
+	connection->bufsize = MPD_BUFFER_INITIAL_LENGTH;
+	connection->maxBufsize = MPD_BUFFER_MAX_LENGTH;
 	connection->buflen = 0;
 	connection->bufstart = 0;
+	connection->linelen = 0;
+	connection->scanned = 0;
+	connection->respLine = 0;
+	connection->respScanned = 0;
+	connection->line = NULL;
+	connection->linesize = 0;
+	connection->tags = NULL;
+	connection->tagssize = 0;
 	strcpy(connection->errorStr,"");
 	connection->error = 0;
 	connection->doneProcessing = 0;
@@ -418,67 +879,229 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
 	connection->doneListOk = 0;
 	connection->returnElement = NULL;
 	connection->request = NULL;
+	connection->connector = NULL;
+	return connection;
+}
+
+static void mpd_freeConnector(mpd_Connection * connection) {
+	struct _mpd_Connector * c = connection->connector;
+#ifdef MPD_HAVE_GAI
+	int i;
+
+	for (i = 0; i < c->next; i++) {
+		if (c->socks[i] >= 0)
+			closesocket(c->socks[i]);
+	}
+	if (c->addrinfo)
+		freeaddrinfo(c->addrinfo);
+#ifdef MPD_HAVE_THREADS
+	if (c->resolver)
+		mpd_cancelResolver(c->resolver);
+#endif
+#endif /* MPD_HAVE_GAI */
+	free(c->host);
+	free(c);
+	connection->connector = NULL;
+}
+
+/* reads welcome message, returns 1 when it's there, 0 if it's not yet
+ * and -1 on error */
+static int mpd_stepWelcome(mpd_Connection * connection) {
+	struct _mpd_Connector * c = connection->connector;
+	char * output;
+	int readed;
+
+	while(!(output = mpd_nextLine(connection))) {
+		readed = mpd_recvBuffer(connection,MSG_DONTWAIT);
+		if(connection->error) return -1;
+		if(readed<0 && SENDRECV_ERRNO_IGNORE) return 0;
+		if(readed<=0) {
+			snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
+					"problems getting a response from"
+					" \"%s\" on port %i : %s",c->host,
+					c->port, readed ? strerror(errno) :
+					"connection closed");
+			connection->error = MPD_ERROR_NORESPONSE;
+			return -1;
+		}
+	}
+
+	if(mpd_parseWelcome(connection,c->host,c->port,output)) return -1;
+	connection->doneProcessing = 1;
+	return 1;
+}
+
+mpd_Connection * mpd_beginConnection(const char * host, int port, float timeout) {
+	mpd_Connection * connection = mpd_allocConnection();
+	struct _mpd_Connector * c;
+#ifdef MPD_HAVE_GAI
+	char service[INTLEN+1];
+	int i, error;
+#endif
 
 	if (winsock_dll_error(connection))
 		return connection;
 
+	c = calloc(1, sizeof(struct _mpd_Connector));
+	c->host = strdup(host);
+	c->port = port;
+	c->phase = MPD_PHASE_WELCOME;
+	c->total = timeout * 1000;
+	gettimeofday(&c->begin, NULL);
+	connection->connector = c;
+	mpd_setConnectionTimeout(connection, timeout);
+
 #ifndef WIN32
-	if (host[0] == '/')
-		err = mpd_connect_un(connection, host, timeout);
-	else
-#endif
-		err = mpd_connect(connection, host, port, timeout);
-	if (err < 0)
+	if (host[0] == '/') {
+		if (mpd_connect_un(connection, host, timeout) < 0)
+			mpd_freeConnector(connection);
 		return connection;
+	}
+#endif
 
-	while(!(rt = strstr(connection->buffer,"\n"))) {
-		tv.tv_sec = connection->timeout.tv_sec;
-		tv.tv_usec = connection->timeout.tv_usec;
-		FD_ZERO(&fds);
-		FD_SET(connection->sock,&fds);
-		if((err = select(connection->sock+1,&fds,NULL,NULL,&tv)) == 1) {
-			int readed;
-			readed = recv(connection->sock,
-					&(connection->buffer[connection->buflen]),
-					MPD_BUFFER_MAX_LENGTH-connection->buflen,0);
-			if(readed<=0) {
-				snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
-						"problems getting a response from"
-						" \"%s\" on port %i : %s",host,
-						port, strerror(errno));
-				connection->error = MPD_ERROR_NORESPONSE;
-				return connection;
-			}
-			connection->buflen+=readed;
-			connection->buffer[connection->buflen] = '\0';
-		}
-		else if(err<0) {
- 			if (SELECT_ERRNO_IGNORE)
-				continue;
-			snprintf(connection->errorStr,
-					MPD_ERRORSTR_MAX_LENGTH,
-					"problems connecting to \"%s\" on port"
-					" %i",host,port);
-			connection->error = MPD_ERROR_CONNPORT;
+#ifdef MPD_HAVE_GAI
+	for (i = 0; i < MPD_CONNECT_MAX_ATTEMPTS; i++)
+		c->socks[i] = -1;
+	snprintf(service, sizeof(service), "%i", port);
+
+	/* numeric address doesn't need a resolver */
+	error = mpd_resolve(host, service, AI_NUMERICHOST, &c->addrinfo);
+	if (error == EAI_NONAME) {
+#ifdef MPD_HAVE_THREADS
+		c->resolver = mpd_startResolver(host, service);
+		if (c->resolver) {
+			c->phase = MPD_PHASE_RESOLVE;
 			return connection;
 		}
-		else {
+#endif
+		error = mpd_resolve(host, service, 0, &c->addrinfo);
+	}
+	if (mpd_resolved(connection, error) < 0)
+		mpd_freeConnector(connection);
+#else /* !MPD_HAVE_GAI */
+	if (mpd_connect(connection, host, port, timeout) < 0)
+		mpd_freeConnector(connection);
+#endif /* !MPD_HAVE_GAI */
+
+	return connection;
+}
+
+int mpd_continueConnection(mpd_Connection * connection) {
+	struct _mpd_Connector * c = connection->connector;
+	int ret = 0;
+
+	if (!c)
+		return connection->error ? -1 : 1;
+
+#ifdef MPD_HAVE_GAI
+#ifdef MPD_HAVE_THREADS
+	if (c->phase == MPD_PHASE_RESOLVE) {
+		int error;
+
+		if (mpd_resolverDone(c->resolver, &error, &c->addrinfo)) {
+			mpd_cancelResolver(c->resolver);
+			c->resolver = NULL;
+			ret = mpd_resolved(connection, error);
+		}
+		else if (mpd_msecsSince(&c->begin) >= c->total) {
+			snprintf(connection->errorStr, MPD_ERRORSTR_MAX_LENGTH,
+			         "host \"%s\" not found: timeout", c->host);
+			connection->error = MPD_ERROR_UNKHOST;
+			ret = -1;
+		}
+	}
+#endif /* MPD_HAVE_THREADS */
+	if (ret == 0 && c->phase == MPD_PHASE_CONNECT) {
+		ret = mpd_stepConnect(connection);
+		if (ret > 0) {
+			int i;
+
+			/* close the attempts that lost the race */
+			for (i = 0; i < c->next; i++) {
+				if (c->socks[i] >= 0)
+					closesocket(c->socks[i]);
+				c->socks[i] = -1;
+			}
+			c->active = 0;
+			connection->errorStr[0] = '\0';
+			c->phase = MPD_PHASE_WELCOME;
+			ret = 0;
+		}
+	}
+#endif /* MPD_HAVE_GAI */
+	if (ret == 0 && c->phase == MPD_PHASE_WELCOME) {
+		ret = mpd_stepWelcome(connection);
+		if (ret == 0 && mpd_msecsSince(&c->begin) >= c->total) {
 			snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
 					"timeout in attempting to get a response from"
-					" \"%s\" on port %i",host,port);
+					" \"%s\" on port %i",c->host,c->port);
 			connection->error = MPD_ERROR_NORESPONSE;
-			return connection;
+			ret = -1;
 		}
 	}
 
-	*rt = '\0';
-	output = strdup(connection->buffer);
-	strcpy(connection->buffer,rt+1);
-	connection->buflen = strlen(connection->buffer);
+	if (ret != 0)
+		mpd_freeConnector(connection);
+	return ret;
+}
+
+int mpd_getConnectingSockets(mpd_Connection * connection, int * socks,
+                             int * write)
+{
+	struct _mpd_Connector * c = connection->connector;
+	int n = 0;
 
-	if(mpd_parseWelcome(connection,host,port,output) == 0) connection->doneProcessing = 1;
+	*write = 0;
+	if (!c)
+		return 0;
+#ifdef MPD_HAVE_GAI
+#ifdef MPD_HAVE_THREADS
+	if (c->phase == MPD_PHASE_RESOLVE) {
+		socks[n++] = c->resolver->pipe[0];
+	}
+#endif
+	if (c->phase == MPD_PHASE_CONNECT) {
+		int i;
 
-	free(output);
+		for (i = 0; i < c->next; i++) {
+			if (c->socks[i] >= 0)
+				socks[n++] = c->socks[i];
+		}
+		*write = 1;
+	}
+#endif /* MPD_HAVE_GAI */
+	if (c->phase == MPD_PHASE_WELCOME)
+		socks[n++] = connection->sock;
+	return n;
+}
+
+long mpd_getConnectingTimeout(mpd_Connection * connection) {
+	struct _mpd_Connector * c = connection->connector;
+	long elapsed, left;
+
+	if (!c)
+		return -1;
+	elapsed = mpd_msecsSince(&c->begin);
+	left = c->total - elapsed;
+#ifdef MPD_HAVE_GAI
+	if (c->phase == MPD_PHASE_CONNECT && c->next < c->n &&
+	    c->last + MPD_CONNECT_ATTEMPT_DELAY - elapsed < left)
+		left = c->last + MPD_CONNECT_ATTEMPT_DELAY - elapsed;
+#endif
+	return left > 0 ? left : 0;
+}
+
+mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
+	mpd_Connection * connection = mpd_beginConnection(host, port, timeout);
+	int socks[MPD_CONNECT_MAX_SOCKETS];
+	int ready[MPD_CONNECT_MAX_SOCKETS];
+	int n, write;
+
+	while (mpd_continueConnection(connection) == 0) {
+		n = mpd_getConnectingSockets(connection, socks, &write);
+		mpd_waitSockets(socks, ready, n, write,
+		                mpd_getConnectingTimeout(connection));
+	}
 
 	return connection;
 }
@@ -489,17 +1112,20 @@ void mpd_clearError(mpd_Connection * connection) {
 }
 
 void mpd_closeConnection(mpd_Connection * connection) {
-	closesocket(connection->sock);
-	if(connection->returnElement) free(connection->returnElement);
+	if (connection->connector)
+		mpd_freeConnector(connection);
+	if (connection->sock >= 0)
+		closesocket(connection->sock);
 	if(connection->request) free(connection->request);
+	free(connection->buffer);
+	free(connection->line);
+	free(connection->tags);
 	free(connection);
 	WSACleanup();
 }
 
 static void mpd_executeCommand(mpd_Connection * connection, char * command) {
 	int ret;
-	struct timeval tv;
-	fd_set fds;
 	char * commandPtr = command;
 	int commandLen = strlen(command);
 
@@ -511,12 +1137,7 @@ static void mpd_executeCommand(mpd_Connection * connection, char * command) {
 
 	mpd_clearError(connection);
 
-	FD_ZERO(&fds);
-	FD_SET(connection->sock,&fds);
-	tv.tv_sec = connection->timeout.tv_sec;
-	tv.tv_usec = connection->timeout.tv_usec;
-
-	while((ret = select(connection->sock+1,NULL,&fds,NULL,&tv)==1) ||
+	while((ret = mpd_waitConnection(connection,1)) == 1 ||
 			(ret==-1 && SELECT_ERRNO_IGNORE)) {
 		ret = send(connection->sock,commandPtr,commandLen,MSG_DONTWAIT);
 		if(ret<=0)
@@ -551,18 +1172,13 @@ static void mpd_executeCommand(mpd_Connection * connection, char * command) {
 
 static void mpd_getNextReturnElement(mpd_Connection * connection) {
 	char * output = NULL;
-	char * rt = NULL;
 	char * name = NULL;
 	char * value = NULL;
-	fd_set fds;
-	struct timeval tv;
 	char * tok = NULL;
 	int readed;
-	char * bufferCheck = NULL;
 	int err;
 	int pos;
 
-	if(connection->returnElement) mpd_freeReturnElement(connection->returnElement);
 	connection->returnElement = NULL;
 
 	if(connection->doneProcessing || (connection->listOks &&
@@ -573,35 +1189,10 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 		return;
 	}
 
-	bufferCheck = connection->buffer+connection->bufstart;
-	while(connection->bufstart>=connection->buflen ||
-			!(rt = strchr(bufferCheck,'\n'))) {
-		if(connection->buflen>=MPD_BUFFER_MAX_LENGTH) {
-			memmove(connection->buffer,
-					connection->buffer+
-					connection->bufstart,
-					connection->buflen-
-					connection->bufstart+1);
-			connection->buflen-=connection->bufstart;
-			connection->bufstart = 0;
-		}
-		if(connection->buflen>=MPD_BUFFER_MAX_LENGTH) {
-			strcpy(connection->errorStr,"buffer overrun");
-			connection->error = MPD_ERROR_BUFFEROVERRUN;
-			connection->doneProcessing = 1;
-			connection->doneListOk = 0;
-			return;
-		}
-		bufferCheck = connection->buffer+connection->buflen;
-		tv.tv_sec = connection->timeout.tv_sec;
-		tv.tv_usec = connection->timeout.tv_usec;
-		FD_ZERO(&fds);
-		FD_SET(connection->sock,&fds);
-		if((err = select(connection->sock+1,&fds,NULL,NULL,&tv) == 1)) {
-			readed = recv(connection->sock,
-					connection->buffer+connection->buflen,
-					MPD_BUFFER_MAX_LENGTH-connection->buflen,
-					MSG_DONTWAIT);
+	while(!(output = mpd_nextLine(connection))) {
+		if((err = mpd_waitConnection(connection,0)) == 1) {
+			readed = mpd_recvBuffer(connection,MSG_DONTWAIT);
+			if(connection->error) return;
 			if(readed<0 && SENDRECV_ERRNO_IGNORE) {
 				continue;
 			}
@@ -613,8 +1204,6 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 				connection->doneListOk = 0;
 				return;
 			}
-			connection->buflen+=readed;
-			connection->buffer[connection->buflen] = '\0';
 		}
 		else if(err<0 && SELECT_ERRNO_IGNORE) continue;
 		else {
@@ -626,10 +1215,6 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 		}
 	}
 
-	*rt = '\0';
-	output = connection->buffer+connection->bufstart;
-	connection->bufstart = rt - connection->buffer + 1;
-
 	if(strcmp(output,"OK")==0) {
 		if(connection->listOks > 0) {
 			strcpy(connection->errorStr, "expected more list_OK's");
@@ -659,7 +1244,8 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 		char * needle;
 		int val;
 
-		strcpy(connection->errorStr, output);
+		snprintf(connection->errorStr, MPD_ERRORSTR_MAX_LENGTH,
+		         "%s", output);
 		connection->error = MPD_ERROR_ACK;
 		connection->errorCode = MPD_ACK_ERROR_UNK;
 		connection->errorAt = MPD_ERROR_AT_UNK;
@@ -685,7 +1271,7 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 	name[pos] = '\0';
 
 	if(value[0]==' ') {
-		connection->returnElement = mpd_newReturnElement(name,&(value[1]));
+		connection->returnElement = mpd_newReturnElement(connection,name,&(value[1]));
 	}
 	else {
 		snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
@@ -694,6 +1280,57 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 	}
 }
 
+int mpd_recvAvailable(mpd_Connection * connection) {
+	int readed;
+
+	/* full buffer is grown, buffer overrun is set if it can't be */
+	readed = mpd_recvBuffer(connection,MSG_DONTWAIT);
+	if(readed<0 && connection->error) return -1;
+	if(readed<0 && SENDRECV_ERRNO_IGNORE) return 0;
+	if(readed<=0) {
+		strcpy(connection->errorStr,"connection closed");
+		connection->error = MPD_ERROR_CONNCLOSED;
+		connection->doneProcessing = 1;
+		connection->doneListOk = 0;
+		return -1;
+	}
+	return readed;
+}
+
+int mpd_responseComplete(mpd_Connection * connection) {
+	const char * buf = connection->buffer;
+	int size = connection->bufsize;
+	int start = connection->bufstart;
+	int i = connection->respLine;
+	int n = connection->respScanned;
+	int done = 0;
+
+	if(connection->doneProcessing) return 1;
+
+	/* line returned last is already consumed, so skip it, the rest was
+	 * searched by previous calls already */
+	if(i < connection->linelen) i = connection->linelen;
+	if(n < i) n = i;
+	while(!done) {
+		for(; n < connection->buflen &&
+				buf[(start+n) % size] != '\n'; n++);
+		if(n >= connection->buflen) break;
+		if((n-i == 2 &&
+		    buf[(start+i) % size] == 'O' &&
+		    buf[(start+i+1) % size] == 'K') ||
+		   (n-i >= 3 &&
+		    buf[(start+i) % size] == 'A' &&
+		    buf[(start+i+1) % size] == 'C' &&
+		    buf[(start+i+2) % size] == 'K'))
+			done = 1;
+		else
+			i = ++n;
+	}
+	connection->respLine = i;
+	connection->respScanned = done ? i : n;
+	return done;
+}
+
 void mpd_finishCommand(mpd_Connection * connection) {
 	while(!connection->doneProcessing) {
 		if(connection->doneListOk) connection->doneListOk = 0;
@@ -716,26 +1353,207 @@ int mpd_nextListOkCommand(mpd_Connection * connection) {
 	return 0;
 }
 
+/* keys of status and song info are looked up by their length and first
+ * character, which leaves at most three candidates to compare with */
+#define MPD_KEY(len,c)	(((len) << 8) | (unsigned char)(c))
+#define MPD_KEY_IS(str)	(memcmp(name,str,sizeof(str)) == 0)
+
+typedef enum mpd_StatusKey {
+	MPD_STATUS_KEY_UNKNOWN,
+	MPD_STATUS_KEY_VOLUME,
+	MPD_STATUS_KEY_REPEAT,
+	MPD_STATUS_KEY_RANDOM,
+	MPD_STATUS_KEY_PLAYLIST,
+	MPD_STATUS_KEY_PLAYLISTLENGTH,
+	MPD_STATUS_KEY_BITRATE,
+	MPD_STATUS_KEY_STATE,
+	MPD_STATUS_KEY_SONG,
+	MPD_STATUS_KEY_SONGID,
+	MPD_STATUS_KEY_TIME,
+	MPD_STATUS_KEY_ERROR,
+	MPD_STATUS_KEY_XFADE,
+	MPD_STATUS_KEY_UPDATING_DB,
+	MPD_STATUS_KEY_AUDIO
+} mpd_StatusKey;
+
+static mpd_StatusKey mpd_statusKey(const char * name) {
+	switch(MPD_KEY(strlen(name),name[0])) {
+	case MPD_KEY(4,'s'):
+		if(MPD_KEY_IS("song")) return MPD_STATUS_KEY_SONG;
+		break;
+	case MPD_KEY(4,'t'):
+		if(MPD_KEY_IS("time")) return MPD_STATUS_KEY_TIME;
+		break;
+	case MPD_KEY(5,'a'):
+		if(MPD_KEY_IS("audio")) return MPD_STATUS_KEY_AUDIO;
+		break;
+	case MPD_KEY(5,'e'):
+		if(MPD_KEY_IS("error")) return MPD_STATUS_KEY_ERROR;
+		break;
+	case MPD_KEY(5,'s'):
+		if(MPD_KEY_IS("state")) return MPD_STATUS_KEY_STATE;
+		break;
+	case MPD_KEY(5,'x'):
+		if(MPD_KEY_IS("xfade")) return MPD_STATUS_KEY_XFADE;
+		break;
+	case MPD_KEY(6,'r'):
+		if(MPD_KEY_IS("repeat")) return MPD_STATUS_KEY_REPEAT;
+		if(MPD_KEY_IS("random")) return MPD_STATUS_KEY_RANDOM;
+		break;
+	case MPD_KEY(6,'s'):
+		if(MPD_KEY_IS("songid")) return MPD_STATUS_KEY_SONGID;
+		break;
+	case MPD_KEY(6,'v'):
+		if(MPD_KEY_IS("volume")) return MPD_STATUS_KEY_VOLUME;
+		break;
+	case MPD_KEY(7,'b'):
+		if(MPD_KEY_IS("bitrate")) return MPD_STATUS_KEY_BITRATE;
+		break;
+	case MPD_KEY(8,'p'):
+		if(MPD_KEY_IS("playlist")) return MPD_STATUS_KEY_PLAYLIST;
+		break;
+	case MPD_KEY(11,'u'):
+		if(MPD_KEY_IS("updating_db")) return MPD_STATUS_KEY_UPDATING_DB;
+		break;
+	case MPD_KEY(14,'p'):
+		if(MPD_KEY_IS("playlistlength"))
+			return MPD_STATUS_KEY_PLAYLISTLENGTH;
+		break;
+	}
+	return MPD_STATUS_KEY_UNKNOWN;
+}
+
+typedef enum mpd_InfoKey {
+	MPD_INFO_KEY_UNKNOWN,
+	/* these start new entity */
+	MPD_INFO_KEY_FILE,
+	MPD_INFO_KEY_DIRECTORY,
+	MPD_INFO_KEY_PLAYLIST,
+	MPD_INFO_KEY_CPOS,
+	/* song tags */
+	MPD_INFO_KEY_ARTIST,
+	MPD_INFO_KEY_ALBUM,
+	MPD_INFO_KEY_TITLE,
+	MPD_INFO_KEY_TRACK,
+	MPD_INFO_KEY_NAME,
+	MPD_INFO_KEY_DATE,
+	MPD_INFO_KEY_GENRE,
+	MPD_INFO_KEY_COMPOSER,
+	MPD_INFO_KEY_PERFORMER,
+	MPD_INFO_KEY_DISC,
+	MPD_INFO_KEY_COMMENT,
+	MPD_INFO_KEY_MUSICBRAINZ_TRACKID,
+	MPD_INFO_KEY_TIME,
+	MPD_INFO_KEY_POS,
+	MPD_INFO_KEY_ID
+} mpd_InfoKey;
+
+static mpd_InfoKey mpd_infoKey(const char * name) {
+	switch(MPD_KEY(strlen(name),name[0])) {
+	case MPD_KEY(2,'I'):
+		if(MPD_KEY_IS("Id")) return MPD_INFO_KEY_ID;
+		break;
+	case MPD_KEY(3,'P'):
+		if(MPD_KEY_IS("Pos")) return MPD_INFO_KEY_POS;
+		break;
+	case MPD_KEY(4,'c'):
+		if(MPD_KEY_IS("cpos")) return MPD_INFO_KEY_CPOS;
+		break;
+	case MPD_KEY(4,'f'):
+		if(MPD_KEY_IS("file")) return MPD_INFO_KEY_FILE;
+		break;
+	case MPD_KEY(4,'D'):
+		if(MPD_KEY_IS("Date")) return MPD_INFO_KEY_DATE;
+		if(MPD_KEY_IS("Disc")) return MPD_INFO_KEY_DISC;
+		break;
+	case MPD_KEY(4,'N'):
+		if(MPD_KEY_IS("Name")) return MPD_INFO_KEY_NAME;
+		break;
+	case MPD_KEY(4,'T'):
+		if(MPD_KEY_IS("Time")) return MPD_INFO_KEY_TIME;
+		break;
+	case MPD_KEY(5,'A'):
+		if(MPD_KEY_IS("Album")) return MPD_INFO_KEY_ALBUM;
+		break;
+	case MPD_KEY(5,'G'):
+		if(MPD_KEY_IS("Genre")) return MPD_INFO_KEY_GENRE;
+		break;
+	case MPD_KEY(5,'T'):
+		if(MPD_KEY_IS("Title")) return MPD_INFO_KEY_TITLE;
+		if(MPD_KEY_IS("Track")) return MPD_INFO_KEY_TRACK;
+		break;
+	case MPD_KEY(6,'A'):
+		if(MPD_KEY_IS("Artist")) return MPD_INFO_KEY_ARTIST;
+		break;
+	case MPD_KEY(7,'C'):
+		if(MPD_KEY_IS("Comment")) return MPD_INFO_KEY_COMMENT;
+		break;
+	case MPD_KEY(8,'C'):
+		if(MPD_KEY_IS("Composer")) return MPD_INFO_KEY_COMPOSER;
+		break;
+	case MPD_KEY(8,'p'):
+		if(MPD_KEY_IS("playlist")) return MPD_INFO_KEY_PLAYLIST;
+		break;
+	case MPD_KEY(9,'d'):
+		if(MPD_KEY_IS("directory")) return MPD_INFO_KEY_DIRECTORY;
+		break;
+	case MPD_KEY(9,'P'):
+		if(MPD_KEY_IS("Performer")) return MPD_INFO_KEY_PERFORMER;
+		break;
+	case MPD_KEY(19,'M'):
+		if(MPD_KEY_IS("MUSICBRAINZ_TRACKID"))
+			return MPD_INFO_KEY_MUSICBRAINZ_TRACKID;
+		break;
+	}
+	return MPD_INFO_KEY_UNKNOWN;
+}
+
+#undef MPD_KEY_IS
+#undef MPD_KEY
+
+/* locale independent replacement for atoi/strtol, stops at the first
+ * character that is not a digit and stores its position in end */
+static long long mpd_parseNumber(const char * str, const char ** end) {
+	long long ret = 0;
+	int negative = (*str == '-');
+
+	if(negative) str++;
+	for(; *str >= '0' && *str <= '9'; str++)
+		ret = ret*10+(*str-'0');
+	if(end) *end = str;
+	return negative ? -ret : ret;
+}
+
 void mpd_sendStatusCommand(mpd_Connection * connection) {
 	mpd_executeCommand(connection,"status\n");
 }
 
 mpd_Status * mpd_getStatus(mpd_Connection * connection) {
-	mpd_Status * status;
+	mpd_Status * status = malloc(sizeof(mpd_Status));
+
+	status->error = NULL;
+	if(mpd_getStatusInto(connection,status) < 0) {
+		mpd_freeStatus(status);
+		return NULL;
+	}
+
+	return status;
+}
 
+int mpd_getStatusInto(mpd_Connection * connection, mpd_Status * status) {
 	/*mpd_executeCommand(connection,"status\n");
 
-	if(connection->error) return NULL;*/
+	if(connection->error) return -1;*/
 
 	if(connection->doneProcessing || (connection->listOks &&
 	   connection->doneListOk))
 	{
-		return NULL;
+		return -1;
 	}
 
 	if(!connection->returnElement) mpd_getNextReturnElement(connection);
 
-	status = malloc(sizeof(mpd_Status));
+	mpd_clearStatus(status);
 	status->volume = -1;
 	status->repeat = 0;
 	status->random = 0;
@@ -751,34 +1569,34 @@ mpd_Status * mpd_getStatus(mpd_Connection * connection) {
 	status->bits = 0;
 	status->channels = 0;
 	status->crossfade = -1;
-	status->error = NULL;
 	status->updatingDb = 0;
 
-	if(connection->error) {
-		free(status);
-		return NULL;
-	}
+	if(connection->error) return -1;
+
 	while(connection->returnElement) {
 		mpd_ReturnElement * re = connection->returnElement;
-		if(strcmp(re->name,"volume")==0) {
-			status->volume = atoi(re->value);
-		}
-		else if(strcmp(re->name,"repeat")==0) {
-			status->repeat = atoi(re->value);
-		}
-		else if(strcmp(re->name,"random")==0) {
-			status->random = atoi(re->value);
-		}
-		else if(strcmp(re->name,"playlist")==0) {
-			status->playlist = strtol(re->value,NULL,10);
-		}
-		else if(strcmp(re->name,"playlistlength")==0) {
-			status->playlistLength = atoi(re->value);
-		}
-		else if(strcmp(re->name,"bitrate")==0) {
-			status->bitRate = atoi(re->value);
-		}
-		else if(strcmp(re->name,"state")==0) {
+		const char * tok;
+
+		switch(mpd_statusKey(re->name)) {
+		case MPD_STATUS_KEY_VOLUME:
+			status->volume = mpd_parseNumber(re->value,NULL);
+			break;
+		case MPD_STATUS_KEY_REPEAT:
+			status->repeat = mpd_parseNumber(re->value,NULL);
+			break;
+		case MPD_STATUS_KEY_RANDOM:
+			status->random = mpd_parseNumber(re->value,NULL);
+			break;
+		case MPD_STATUS_KEY_PLAYLIST:
+			status->playlist = mpd_parseNumber(re->value,NULL);
+			break;
+		case MPD_STATUS_KEY_PLAYLISTLENGTH:
+			status->playlistLength = mpd_parseNumber(re->value,NULL);
+			break;
+		case MPD_STATUS_KEY_BITRATE:
+			status->bitRate = mpd_parseNumber(re->value,NULL);
+			break;
+		case MPD_STATUS_KEY_STATE:
 			if(strcmp(re->value,"play")==0) {
 				status->state = MPD_STATUS_STATE_PLAY;
 			}
@@ -791,65 +1609,64 @@ mpd_Status * mpd_getStatus(mpd_Connection * connection) {
 			else {
 				status->state = MPD_STATUS_STATE_UNKNOWN;
 			}
-		}
-		else if(strcmp(re->name,"song")==0) {
-			status->song = atoi(re->value);
-		}
-		else if(strcmp(re->name,"songid")==0) {
-			status->songid = atoi(re->value);
-		}
-		else if(strcmp(re->name,"time")==0) {
-			char * tok = strchr(re->value,':');
-			/* the second strchr below is a safety check */
-			if (tok && (strchr(tok,0) > (tok+1))) {
-				/* atoi stops at the first non-[0-9] char: */
-				status->elapsedTime = atoi(re->value);
-				status->totalTime = atoi(tok+1);
+			break;
+		case MPD_STATUS_KEY_SONG:
+			status->song = mpd_parseNumber(re->value,NULL);
+			break;
+		case MPD_STATUS_KEY_SONGID:
+			status->songid = mpd_parseNumber(re->value,NULL);
+			break;
+		case MPD_STATUS_KEY_TIME:
+			/* both parts have to be there */
+			mpd_parseNumber(re->value,&tok);
+			if(tok[0] == ':' && tok[1]) {
+				status->elapsedTime = mpd_parseNumber(re->value,NULL);
+				status->totalTime = mpd_parseNumber(tok+1,NULL);
 			}
-		}
-		else if(strcmp(re->name,"error")==0) {
-			status->error = strdup(re->value);
-		}
-		else if(strcmp(re->name,"xfade")==0) {
-			status->crossfade = atoi(re->value);
-		}
-		else if(strcmp(re->name,"updating_db")==0) {
-			status->updatingDb = atoi(re->value);
-		}
-		else if(strcmp(re->name,"audio")==0) {
-			char * tok = strchr(re->value,':');
-			if (tok && (strchr(tok,0) > (tok+1))) {
-				status->sampleRate = atoi(re->value);
-				status->bits = atoi(++tok);
-				tok = strchr(tok,':');
-				if (tok && (strchr(tok,0) > (tok+1)))
-					status->channels = atoi(tok+1);
+			break;
+		case MPD_STATUS_KEY_ERROR:
+			if(!status->error) status->error = strdup(re->value);
+			break;
+		case MPD_STATUS_KEY_XFADE:
+			status->crossfade = mpd_parseNumber(re->value,NULL);
+			break;
+		case MPD_STATUS_KEY_UPDATING_DB:
+			status->updatingDb = mpd_parseNumber(re->value,NULL);
+			break;
+		case MPD_STATUS_KEY_AUDIO:
+			mpd_parseNumber(re->value,&tok);
+			if(tok[0] == ':' && tok[1]) {
+				status->sampleRate = mpd_parseNumber(re->value,NULL);
+				status->bits = mpd_parseNumber(tok+1,&tok);
+				if(tok[0] == ':' && tok[1])
+					status->channels = mpd_parseNumber(tok+1,NULL);
 			}
+			break;
+		default:
+			break;
 		}
 
 		mpd_getNextReturnElement(connection);
-		if(connection->error) {
-			free(status);
-			return NULL;
-		}
+		if(connection->error) return -1;
 	}
 
-	if(connection->error) {
-		free(status);
-		return NULL;
-	}
+	if(connection->error) return -1;
 	else if(status->state<0) {
 		strcpy(connection->errorStr,"state not found");
 		connection->error = 1;
-		free(status);
-		return NULL;
+		return -1;
 	}
 
-	return status;
+	return 0;
 }
 
-void mpd_freeStatus(mpd_Status * status) {
+void mpd_clearStatus(mpd_Status * status) {
 	if(status->error) free(status->error);
+	status->error = NULL;
+}
+
+void mpd_freeStatus(mpd_Status * status) {
+	mpd_clearStatus(status);
 	free(status);
 }
 
@@ -976,41 +1793,56 @@ void mpd_freeSearchStats(mpd_SearchStats * stats)
 	free(stats);
 }
 
+/* string fields of mpd_Song, they are all kept in the same block of
+ * memory as the structure itself, right after it */
+static const size_t mpdSongStrings[] =
+{
+	offsetof(mpd_Song,file),
+	offsetof(mpd_Song,artist),
+	offsetof(mpd_Song,title),
+	offsetof(mpd_Song,album),
+	offsetof(mpd_Song,track),
+	offsetof(mpd_Song,name),
+	offsetof(mpd_Song,date),
+	offsetof(mpd_Song,genre),
+	offsetof(mpd_Song,composer),
+	offsetof(mpd_Song,performer),
+	offsetof(mpd_Song,disc),
+	offsetof(mpd_Song,comment),
+	offsetof(mpd_Song,musicbrainz_trackid)
+};
+
+#define MPD_SONG_STRINGS \
+	(int)(sizeof(mpdSongStrings)/sizeof(mpdSongStrings[0]))
+#define mpd_songString(song,i) \
+	(*(char **)((char *)(song)+mpdSongStrings[i]))
+
 static void mpd_initSong(mpd_Song * song) {
-	song->file = NULL;
-	song->artist = NULL;
-	song->album = NULL;
-	song->track = NULL;
-	song->title = NULL;
-	song->name = NULL;
-	song->date = NULL;
-	/* added by Qball */
-	song->genre = NULL;
-	song->composer = NULL;
-	song->performer = NULL;
-	song->disc = NULL;
-	song->comment = NULL;
-	song->musicbrainz_trackid = NULL;
+	int i;
+
+	for(i = 0; i < MPD_SONG_STRINGS; i++) mpd_songString(song,i) = NULL;
 
 	song->time = MPD_SONG_NO_TIME;
 	song->pos = MPD_SONG_NO_NUM;
 	song->id = MPD_SONG_NO_ID;
 }
 
-static void mpd_finishSong(mpd_Song * song) {
-	if(song->file) free(song->file);
-	if(song->artist) free(song->artist);
-	if(song->album) free(song->album);
-	if(song->title) free(song->title);
-	if(song->track) free(song->track);
-	if(song->name) free(song->name);
-	if(song->date) free(song->date);
-	if(song->genre) free(song->genre);
-	if(song->composer) free(song->composer);
-	if(song->performer) free(song->performer);
-	if(song->disc) free(song->disc);
-	if(song->comment) free(song->comment);
-	if(song->musicbrainz_trackid) free(song->musicbrainz_trackid);
+/* allocates song along with length bytes of string data, which are
+ * copied from strings and pointed to by its fields according to offsets
+ * (-1 means there is no such string) */
+static mpd_Song * mpd_packSong(const mpd_Song * song, const char * strings,
+		const int * offsets, size_t length) {
+	mpd_Song * ret = malloc(sizeof(mpd_Song)+length);
+	char * data = (char *)(ret+1);
+	int i;
+
+	*ret = *song;
+	if(length) memcpy(data,strings,length);
+	for(i = 0; i < MPD_SONG_STRINGS; i++) {
+		mpd_songString(ret,i) = offsets[i] < 0 ? NULL : data+offsets[i];
+	}
+
+	return ret;
 }
 
 mpd_Song * mpd_newSong(void) {
@@ -1022,32 +1854,29 @@ mpd_Song * mpd_newSong(void) {
 }
 
 void mpd_freeSong(mpd_Song * song) {
-	if (song)
-		mpd_finishSong(song);
 	free(song);
 }
 
 mpd_Song * mpd_songDup(mpd_Song * song) {
-	mpd_Song * ret = mpd_newSong();
-
-	if(song->file) ret->file = strdup(song->file);
-	if(song->artist) ret->artist = strdup(song->artist);
-	if(song->album) ret->album = strdup(song->album);
-	if(song->title) ret->title = strdup(song->title);
-	if(song->track) ret->track = strdup(song->track);
-	if(song->name) ret->name = strdup(song->name);
-	if(song->date) ret->date = strdup(song->date);
-	if(song->genre) ret->genre= strdup(song->genre);
-	if(song->composer) ret->composer= strdup(song->composer);
-	if(song->performer) ret->performer = strdup(song->performer);
-	if(song->disc) ret->disc = strdup(song->disc);
-	if(song->comment) ret->comment = strdup(song->comment);
-	if(song->musicbrainz_trackid) ret->musicbrainz_trackid = strdup(song->musicbrainz_trackid);
-	ret->time = song->time;
-	ret->pos = song->pos;
-	ret->id = song->id;
+	char * first = NULL;
+	char * last = NULL;
+	int offsets[MPD_SONG_STRINGS];
+	int i;
 
-	return ret;
+	/* strings are packed one after another, so the whole block can be
+	 * copied at once */
+	for(i = 0; i < MPD_SONG_STRINGS; i++) {
+		char * str = mpd_songString(song,i);
+		if(str && (!first || str < first)) first = str;
+		if(str && (!last || str > last)) last = str;
+	}
+	for(i = 0; i < MPD_SONG_STRINGS; i++) {
+		char * str = mpd_songString(song,i);
+		offsets[i] = str ? str-first : -1;
+	}
+
+	return mpd_packSong(song,first,offsets,
+			first ? last+strlen(last)+1-first : 0);
 }
 
 static void mpd_initDirectory(mpd_Directory * directory) {
@@ -1144,8 +1973,99 @@ static void mpd_sendInfoCommand(mpd_Connection * connection, char * command) {
 	mpd_executeCommand(connection,command);
 }
 
+/* appends value to tags buffer of connection, length is the number of
+ * bytes used so far; returns offset of the value in the buffer */
+static int mpd_addTag(mpd_Connection * connection, int * length,
+		const char * value) {
+	int len = strlen(value)+1;
+	int offset = *length;
+
+	if(offset+len > connection->tagssize) {
+		int size = connection->tagssize ? connection->tagssize : 256;
+		while(size < offset+len) size *= 2;
+		connection->tags = realloc(connection->tags,size);
+		connection->tagssize = size;
+	}
+	memcpy(connection->tags+offset,value,len);
+	*length += len;
+
+	return offset;
+}
+
+/* reads tags of song that starts with the current element into song and
+ * tags buffer of connection, offsets of the strings in the buffer are
+ * stored in offsets and their total length in length */
+static void mpd_collectSong(mpd_Connection * connection, mpd_Song * song,
+		int * offsets, int * length) {
+	int i;
+
+	mpd_initSong(song);
+	for(i = 0; i < MPD_SONG_STRINGS; i++) offsets[i] = -1;
+	*length = 0;
+	if(mpd_infoKey(connection->returnElement->name) == MPD_INFO_KEY_FILE) {
+		offsets[0] = mpd_addTag(connection,length,
+				connection->returnElement->value);
+	}
+	else {
+		song->pos =
+			mpd_parseNumber(connection->returnElement->value,NULL);
+	}
+
+	mpd_getNextReturnElement(connection);
+	while(connection->returnElement) {
+		mpd_ReturnElement * re = connection->returnElement;
+		mpd_InfoKey key = mpd_infoKey(re->name);
+
+		if(key >= MPD_INFO_KEY_FILE && key <= MPD_INFO_KEY_CPOS)
+			break;
+
+		if(re->value[0]) {
+			/* index in mpdSongStrings */
+			i = -1;
+
+			switch(key) {
+			case MPD_INFO_KEY_ARTIST: i = 1; break;
+			case MPD_INFO_KEY_TITLE: i = 2; break;
+			case MPD_INFO_KEY_ALBUM: i = 3; break;
+			case MPD_INFO_KEY_TRACK: i = 4; break;
+			case MPD_INFO_KEY_NAME: i = 5; break;
+			case MPD_INFO_KEY_DATE: i = 6; break;
+			case MPD_INFO_KEY_GENRE: i = 7; break;
+			case MPD_INFO_KEY_COMPOSER: i = 8; break;
+			case MPD_INFO_KEY_PERFORMER: i = 9; break;
+			case MPD_INFO_KEY_DISC: i = 10; break;
+			case MPD_INFO_KEY_COMMENT: i = 11; break;
+			case MPD_INFO_KEY_MUSICBRAINZ_TRACKID: i = 12; break;
+			case MPD_INFO_KEY_TIME:
+				if(song->time == MPD_SONG_NO_TIME)
+					song->time = mpd_parseNumber(re->value,NULL);
+				break;
+			case MPD_INFO_KEY_POS:
+				if(song->pos == MPD_SONG_NO_NUM)
+					song->pos = mpd_parseNumber(re->value,NULL);
+				break;
+			case MPD_INFO_KEY_ID:
+				if(song->id == MPD_SONG_NO_ID)
+					song->id = mpd_parseNumber(re->value,NULL);
+				break;
+			default:
+				break;
+			}
+			if(i >= 0 && offsets[i] < 0) {
+				offsets[i] = mpd_addTag(connection,length,re->value);
+			}
+		}
+
+		mpd_getNextReturnElement(connection);
+	}
+}
+
 mpd_InfoEntity * mpd_getNextInfoEntity(mpd_Connection * connection) {
 	mpd_InfoEntity * entity = NULL;
+	/* song is collected here and packed into one block at the end */
+	mpd_Song song;
+	int offsets[MPD_SONG_STRINGS];
+	int length;
 
 	if(connection->doneProcessing || (connection->listOks &&
 	   connection->doneListOk))
@@ -1156,35 +2076,30 @@ mpd_InfoEntity * mpd_getNextInfoEntity(mpd_Connection * connection) {
 	if(!connection->returnElement) mpd_getNextReturnElement(connection);
 
 	if(connection->returnElement) {
-		if(strcmp(connection->returnElement->name,"file")==0) {
+		switch(mpd_infoKey(connection->returnElement->name)) {
+		case MPD_INFO_KEY_FILE:
+		case MPD_INFO_KEY_CPOS:
 			entity = mpd_newInfoEntity();
 			entity->type = MPD_INFO_ENTITY_TYPE_SONG;
-			entity->info.song = mpd_newSong();
-			entity->info.song->file =
-				strdup(connection->returnElement->value);
-		}
-		else if(strcmp(connection->returnElement->name,
-					"directory")==0) {
+			mpd_collectSong(connection,&song,offsets,&length);
+			entity->info.song = mpd_packSong(&song,connection->tags,
+					offsets,length);
+			return entity;
+		case MPD_INFO_KEY_DIRECTORY:
 			entity = mpd_newInfoEntity();
 			entity->type = MPD_INFO_ENTITY_TYPE_DIRECTORY;
 			entity->info.directory = mpd_newDirectory();
 			entity->info.directory->path =
 				strdup(connection->returnElement->value);
-		}
-		else if(strcmp(connection->returnElement->name,"playlist")==0) {
+			break;
+		case MPD_INFO_KEY_PLAYLIST:
 			entity = mpd_newInfoEntity();
 			entity->type = MPD_INFO_ENTITY_TYPE_PLAYLISTFILE;
 			entity->info.playlistFile = mpd_newPlaylistFile();
 			entity->info.playlistFile->path =
 				strdup(connection->returnElement->value);
-		}
-		else if(strcmp(connection->returnElement->name, "cpos") == 0){
-			entity = mpd_newInfoEntity();
-			entity->type = MPD_INFO_ENTITY_TYPE_SONG;
-			entity->info.song = mpd_newSong();
-			entity->info.song->pos = atoi(connection->returnElement->value);
-		}
-		else {
+			break;
+		default:
 			connection->error = 1;
 			strcpy(connection->errorStr,"problem parsing song info");
 			return NULL;
@@ -1192,89 +2107,53 @@ mpd_InfoEntity * mpd_getNextInfoEntity(mpd_Connection * connection) {
 	}
 	else return NULL;
 
+	/* the rest of directory or playlist isn't needed */
 	mpd_getNextReturnElement(connection);
 	while(connection->returnElement) {
-		mpd_ReturnElement * re = connection->returnElement;
-
-		if(strcmp(re->name,"file")==0) return entity;
-		else if(strcmp(re->name,"directory")==0) return entity;
-		else if(strcmp(re->name,"playlist")==0) return entity;
-		else if(strcmp(re->name,"cpos")==0) return entity;
-
-		if(entity->type == MPD_INFO_ENTITY_TYPE_SONG &&
-				strlen(re->value)) {
-			if(!entity->info.song->artist &&
-					strcmp(re->name,"Artist")==0) {
-				entity->info.song->artist = strdup(re->value);
-			}
-			else if(!entity->info.song->album &&
-					strcmp(re->name,"Album")==0) {
-				entity->info.song->album = strdup(re->value);
-			}
-			else if(!entity->info.song->title &&
-					strcmp(re->name,"Title")==0) {
-				entity->info.song->title = strdup(re->value);
-			}
-			else if(!entity->info.song->track &&
-					strcmp(re->name,"Track")==0) {
-				entity->info.song->track = strdup(re->value);
-			}
-			else if(!entity->info.song->name &&
-					strcmp(re->name,"Name")==0) {
-				entity->info.song->name = strdup(re->value);
-			}
-			else if(entity->info.song->time==MPD_SONG_NO_TIME &&
-					strcmp(re->name,"Time")==0) {
-				entity->info.song->time = atoi(re->value);
-			}
-			else if(entity->info.song->pos==MPD_SONG_NO_NUM &&
-					strcmp(re->name,"Pos")==0) {
-				entity->info.song->pos = atoi(re->value);
-			}
-			else if(entity->info.song->id==MPD_SONG_NO_ID &&
-					strcmp(re->name,"Id")==0) {
-				entity->info.song->id = atoi(re->value);
-			}
-			else if(!entity->info.song->date &&
-					strcmp(re->name, "Date") == 0) {
-				entity->info.song->date = strdup(re->value);
-			}
-			else if(!entity->info.song->genre &&
-					strcmp(re->name, "Genre") == 0) {
-				entity->info.song->genre = strdup(re->value);
-			}
-			else if(!entity->info.song->composer &&
-					strcmp(re->name, "Composer") == 0) {
-				entity->info.song->composer = strdup(re->value);
-			}
-			else if(!entity->info.song->performer &&
-					strcmp(re->name, "Performer") == 0) {
-				entity->info.song->performer = strdup(re->value);
-			}
-			else if(!entity->info.song->disc &&
-					strcmp(re->name, "Disc") == 0) {
-				entity->info.song->disc = strdup(re->value);
-			}
-			else if(!entity->info.song->comment &&
-					strcmp(re->name, "Comment") == 0) {
-				entity->info.song->comment = strdup(re->value);
-			}
-			else if(!entity->info.song->musicbrainz_trackid &&
-					strcmp(re->name, "MUSICBRAINZ_TRACKID") == 0) {
-				entity->info.song->musicbrainz_trackid = strdup(re->value);
-			}
-		}
-		else if(entity->type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
-		}
-		else if(entity->type == MPD_INFO_ENTITY_TYPE_PLAYLISTFILE) {
-		}
+		mpd_InfoKey key = mpd_infoKey(connection->returnElement->name);
 
+		if(key >= MPD_INFO_KEY_FILE && key <= MPD_INFO_KEY_CPOS)
+			break;
 		mpd_getNextReturnElement(connection);
 	}
 
 	return entity;
 }
 
+int mpd_getSongView(mpd_Connection * connection, mpd_Song * song) {
+	int offsets[MPD_SONG_STRINGS];
+	int length;
+	int i;
+
+	if(connection->doneProcessing || (connection->listOks &&
+	   connection->doneListOk))
+	{
+		return -1;
+	}
+
+	if(!connection->returnElement) mpd_getNextReturnElement(connection);
+	if(!connection->returnElement) return -1;
+
+	switch(mpd_infoKey(connection->returnElement->name)) {
+	case MPD_INFO_KEY_FILE:
+	case MPD_INFO_KEY_CPOS:
+		break;
+	default:
+		connection->error = 1;
+		strcpy(connection->errorStr,"problem parsing song info");
+		return -1;
+	}
+
+	mpd_collectSong(connection,song,offsets,&length);
+	/* tags buffer doesn't move anymore, so strings can point to it */
+	for(i = 0; i < MPD_SONG_STRINGS; i++) {
+		mpd_songString(song,i) =
+			offsets[i] < 0 ? NULL : connection->tags+offsets[i];
+	}
+
+	return 0;
+}
+
 static char * mpd_getNextReturnElementNamed(mpd_Connection * connection,
 		const char * name)
 {
@@ -1711,6 +2590,72 @@ void mpd_sendCommandListEnd(mpd_Connection * connection) {
 	mpd_executeCommand(connection,"command_list_end\n");
 }
 
+static const char * mpdIdleNames[] =
+{
+	"database",
+	"stored_playlist",
+	"playlist",
+	"player",
+	"mixer",
+	"output",
+	"options",
+	"update",
+	NULL
+};
+
+void mpd_sendIdleCommand(mpd_Connection * connection, int mask) {
+	char string[128];
+	int i, len;
+
+	strcpy(string, "idle");
+	len = strlen(string);
+	for(i = 0; mpdIdleNames[i]; i++) {
+		if(mask & (1 << i)) {
+			string[len++] = ' ';
+			strcpy(string+len, mpdIdleNames[i]);
+			len += strlen(mpdIdleNames[i]);
+		}
+	}
+	strcpy(string+len, "\n");
+	mpd_executeCommand(connection,string);
+}
+
+void mpd_sendNoIdleCommand(mpd_Connection * connection) {
+	/* idle is still pending, so mpd_executeCommand has to be fooled
+	 * into thinking that nothing is being processed */
+	if(connection->doneProcessing) return;
+	connection->doneProcessing = 1;
+	mpd_executeCommand(connection,"noidle\n");
+}
+
+int mpd_getIdleEvents(mpd_Connection * connection) {
+	int events = 0;
+	int i;
+
+	if(connection->doneProcessing || (connection->listOks &&
+	   connection->doneListOk))
+	{
+		return 0;
+	}
+
+	if(!connection->returnElement) mpd_getNextReturnElement(connection);
+
+	while(connection->returnElement) {
+		mpd_ReturnElement * re = connection->returnElement;
+		if(strcmp(re->name,"changed")==0) {
+			for(i = 0; mpdIdleNames[i]; i++) {
+				if(strcmp(re->value,mpdIdleNames[i])==0) {
+					events |= 1 << i;
+					break;
+				}
+			}
+		}
+		mpd_getNextReturnElement(connection);
+	}
+
+	return connection->error ? 0 : events;
+}
+
 void mpd_sendOutputsCommand(mpd_Connection * connection) {
 	mpd_executeCommand(connection,"outputs\n");
 }
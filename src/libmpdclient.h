@@ -39,8 +39,11 @@
 
 #include <sys/time.h>
 #include <stdarg.h>
-#define MPD_BUFFER_MAX_LENGTH	50000
+#define MPD_BUFFER_INITIAL_LENGTH	16384
+#define MPD_BUFFER_MAX_LENGTH	1048576
 #define MPD_ERRORSTR_MAX_LENGTH	1000
+/* maximum number of sockets mpd_getConnectingSockets can return */
+#define MPD_CONNECT_MAX_SOCKETS	8
 #define MPD_WELCOME_MESSAGE	"OK MPD "
 
 #define MPD_ERROR_TIMEOUT	10 /* timeout trying to talk to mpd */
@@ -95,7 +98,10 @@ typedef enum mpd_TagItems
 
 extern char * mpdTagItemKeys[MPD_TAG_NUM_OF_ITEM_TYPES];
 
-/* internal stuff don't touch this struct */
+/* internal stuff don't touch this struct
+ * name and value point into connection's buffer, so they are valid only
+ * until the next element is read; strdup them if you want to keep them
+ */
 typedef struct _mpd_ReturnElement {
 	char * name;
 	char * value;
@@ -116,16 +122,37 @@ typedef struct _mpd_Connection {
 	int error;
 	/* DON'T TOUCH any of the rest of this stuff */
 	int sock;
-	char buffer[MPD_BUFFER_MAX_LENGTH+1];
-	int buflen;
+	/* receive buffer is a ring that grows on demand up to maxBufsize,
+	 * unread data is buflen bytes starting at bufstart */
+	char * buffer;
+	int bufsize;
+	int maxBufsize;
 	int bufstart;
+	int buflen;
+	/* length of the last returned line, released with the next one */
+	int linelen;
+	/* number of unread bytes already known not to contain a newline */
+	int scanned;
+	/* mpd_responseComplete goes on from here: start of the first line
+	 * that wasn't seen whole yet and how far it was searched */
+	int respLine;
+	int respScanned;
+	/* lines that wrap around the end of buffer are copied here */
+	char * line;
+	int linesize;
+	/* tags of song being parsed, see mpd_getNextInfoEntity */
+	char * tags;
+	int tagssize;
 	int doneProcessing;
 	int listOks;
 	int doneListOk;
 	int commandList;
 	mpd_ReturnElement * returnElement;
+	mpd_ReturnElement element;
 	struct timeval timeout;
 	char *request;
+	/* state of connection that is being established */
+	struct _mpd_Connector * connector;
 } mpd_Connection;
 
 /* mpd_newConnection
@@ -136,8 +163,43 @@ typedef struct _mpd_Connection {
  */
 mpd_Connection * mpd_newConnection(const char * host, int port, float timeout);
 
+/* mpd_beginConnection
+ * non-blocking version of mpd_newConnection, it only starts connecting:
+ * host name is resolved in a separate thread (if threads are available)
+ * and addresses are connected to without waiting. call
+ * mpd_continueConnection whenever one of the sockets returned by
+ * mpd_getConnectingSockets is ready or mpd_getConnectingTimeout expires
+ */
+mpd_Connection * mpd_beginConnection(const char * host, int port, float timeout);
+
+/* mpd_continueConnection
+ * does as much of connecting as it can without blocking, returns 1 when
+ * welcome message is read, 0 if it's still in progress or -1 on error
+ */
+int mpd_continueConnection(mpd_Connection * connection);
+
+/* mpd_getConnectingSockets
+ * fills socks (room for MPD_CONNECT_MAX_SOCKETS) with sockets connecting
+ * is waiting for and returns their number; write is set if they are
+ * waited for to become writable, readable otherwise. the set changes and
+ * sockets can be closed with each call to mpd_continueConnection
+ */
+int mpd_getConnectingSockets(mpd_Connection * connection, int * socks, int * write);
+
+/* mpd_getConnectingTimeout
+ * returns number of ms after which mpd_continueConnection has to be called
+ * even if no socket is ready (-1 if connection is already established)
+ */
+long mpd_getConnectingTimeout(mpd_Connection * connection);
+
 void mpd_setConnectionTimeout(mpd_Connection * connection, float timeout);
 
+/* mpd_setBufferLimit
+ * sets how much the receive buffer can grow (MPD_BUFFER_MAX_LENGTH by
+ * default), it has to hold at least one whole line of response
+ */
+void mpd_setBufferLimit(mpd_Connection * connection, int size);
+
 /* mpd_closeConnection
  * use this to close a connection and free'ing subsequent memory
  */
@@ -148,6 +210,20 @@ void mpd_closeConnection(mpd_Connection * connection);
  */
 void mpd_clearError(mpd_Connection * connection);
 
+/* mpd_recvAvailable
+ * reads whatever is waiting on the socket without blocking, growing the
+ * buffer if it's full. returns number of bytes read (0 if there was
+ * nothing) or -1 if connection was closed or buffer can't grow anymore
+ */
+int mpd_recvAvailable(mpd_Connection * connection);
+
+/* mpd_responseComplete
+ * returns 1 if the whole response to the current command (ended with OK or
+ * ACK) is already buffered, so it can be read without blocking. data that
+ * was checked by previous calls isn't searched again.
+ */
+int mpd_responseComplete(mpd_Connection * connection);
+
 /* STATUS STUFF */
 
 /* use these with status.state to determine what state the player is in */
@@ -212,6 +288,19 @@ void mpd_sendStatusCommand(mpd_Connection * connection);
  */
 mpd_Status * mpd_getStatus(mpd_Connection * connection);
 
+/* mpd_getStatusInto
+ * same as mpd_getStatus, but parses status into caller's storage,
+ * which has to be cleared with mpd_clearStatus() when no longer needed
+ * (status->error must be NULL or malloc'd before first use)
+ * returns 0 on success, -1 on error
+ */
+int mpd_getStatusInto(mpd_Connection * connection, mpd_Status * status);
+
+/* mpd_clearStatus
+ * free's memory held by status filled with mpd_getStatusInto
+ */
+void mpd_clearStatus(mpd_Status * status);
+
 /* mpd_freeStatus
  * free's status info malloc'd and returned by mpd_getStatus
  */
@@ -250,6 +339,8 @@ void mpd_freeSearchStats(mpd_SearchStats * stats);
 
 /* mpd_Song
  * for storing song info returned by mpd
+ * strings of a song are stored in the same block of memory as the song
+ * itself, so they must not be freed or reassigned separately
  */
 typedef struct _mpd_Song {
 	/* filename of song */
@@ -293,17 +384,16 @@ typedef struct _mpd_Song {
 
 /* mpd_newSong
  * use to allocate memory for a new mpd_Song
- * file, artist, etc all initialized to NULL
- * if your going to assign values to file, artist, etc
- * be sure to malloc or strdup the memory
- * use mpd_freeSong to free the memory for the mpd_Song, it will also
- * free memory for file, artist, etc, so don't do it yourself
+ * file, artist, etc all initialized to NULL and there is no room for
+ * them, songs with tags come only from mpd_getNextInfoEntity and
+ * mpd_songDup
+ * use mpd_freeSong to free the memory for the mpd_Song
  */
 mpd_Song * mpd_newSong(void);
 
 /* mpd_freeSong
- * use to free memory allocated by mpd_newSong
- * also it will free memory pointed to by file, artist, etc, so be careful
+ * use to free memory allocated by mpd_newSong, mpd_songDup or
+ * mpd_getNextInfoEntity, it frees file, artist, etc along with it
  */
 void mpd_freeSong(mpd_Song * song);
 
@@ -398,6 +488,13 @@ void mpd_freeInfoEntity(mpd_InfoEntity * entity);
 /* use this function to loop over after calling Info/Listall functions */
 mpd_InfoEntity * mpd_getNextInfoEntity(mpd_Connection * connection);
 
+/* mpd_getSongView
+ * reads next song of the response into song without allocating it, its
+ * strings point to connection and are valid until the next call, use
+ * mpd_songDup to keep it. returns 0 or -1 if there is no song left
+ */
+int mpd_getSongView(mpd_Connection * connection, mpd_Song * song);
+
 /* fetches the currently seeletect song (the song referenced by status->song
  * and status->songid*/
 void mpd_sendCurrentSongCommand(mpd_Connection * connection);
@@ -542,6 +639,38 @@ void mpd_sendCommandListEnd(mpd_Connection * connection);
  * returns -1 if it advanced to an OK or ACK */
 int mpd_nextListOkCommand(mpd_Connection * connection);
 
+/* IDLE STUFF */
+
+/* subsystems that can be passed to mpd_sendIdleCommand, mpd_getIdleEvents
+ * returns a mask of these too */
+#define MPD_IDLE_DATABASE		0x0001
+#define MPD_IDLE_STORED_PLAYLIST	0x0002
+#define MPD_IDLE_PLAYLIST		0x0004
+#define MPD_IDLE_PLAYER			0x0008
+#define MPD_IDLE_MIXER			0x0010
+#define MPD_IDLE_OUTPUT			0x0020
+#define MPD_IDLE_OPTIONS		0x0040
+#define MPD_IDLE_UPDATE			0x0080
+
+/* mpd_sendIdleCommand
+ * waits until one of subsystems in mask (0 means any of them) changes,
+ * requires mpd >= 0.14. while idling no other command can be sent,
+ * use mpd_sendNoIdleCommand to leave idle mode first
+ */
+void mpd_sendIdleCommand(mpd_Connection * connection, int mask);
+
+/* mpd_sendNoIdleCommand
+ * interrupts pending idle command, call mpd_getIdleEvents afterwards
+ * to read its response
+ */
+void mpd_sendNoIdleCommand(mpd_Connection * connection);
+
+/* mpd_getIdleEvents
+ * returns mask of subsystems that changed (0 if idle was interrupted
+ * by noidle), call this after mpd_sendIdleCommand or mpd_sendNoIdleCommand
+ */
+int mpd_getIdleEvents(mpd_Connection * connection);
+
 typedef struct _mpd_OutputEntity {
 	int id;
 	char * name;
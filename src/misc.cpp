@@ -25,8 +25,13 @@
 #include <iostream>
 #include <openssl/evp.h>
 #include <pwd.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #include "configuration.h"
 #include "misc.h"
 
@@ -78,16 +83,6 @@ bool Daemonize()
 		return false;
 }
 
-void WriteCache(const std::string &s)
-{
-	std::ofstream f(Config.file_cache.c_str(), std::ios::app);
-	if (f.is_open())
-	{
-		f << s << std::endl;
-		f.close();
-	}
-}
-
 void Log(LogLevel ll, const char *format, ...)
 {
 	if (Config.log_level < ll)
@@ -113,6 +108,85 @@ void IgnoreNewlines(std::string &s)
 		s.replace(i, 1, "");
 }
 
+namespace
+{
+	const char hex_digits[] = "0123456789ABCDEF";
+	
+	bool IsUnreserved(unsigned char c)
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+		||      c == '-' || c == '.' || c == '_' || c == '~';
+	}
+	
+#	ifdef __SSE2__
+	// returns mask with bits set for unreserved bytes among 16 at p
+	unsigned UnreservedMask(const char *p)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		// bytes above 0x7f compare as negative, so they're never in range
+		__m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a'-1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('z'+1)));
+		ok = _mm_or_si128(ok, _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0'-1)), _mm_cmplt_epi8(x, _mm_set1_epi8('9'+1))));
+		ok = _mm_or_si128(ok, _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('-'-1)), _mm_cmplt_epi8(x, _mm_set1_epi8('.'+1))));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, _mm_set1_epi8('_')));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, _mm_set1_epi8('~')));
+		return _mm_movemask_epi8(ok);
+	}
+#	endif // __SSE2__
+}
+
+// appends str percent-encoded the same way as curl_easy_escape does
+void AppendEscaped(std::string &out, const char *str, size_t length)
+{
+	size_t old_size = out.size();
+	out.resize(old_size + 3*length);
+	char *dst = &out[0] + old_size;
+	
+	size_t i = 0;
+#	ifdef __SSE2__
+	while (i + 16 <= length)
+	{
+		const char *block = str + i;
+		unsigned reserved = ~UnreservedMask(block) & 0xffff;
+		// unreserved runs between reserved bytes are copied as they are,
+		// reserved ones are taken from the mask, so block is loaded once
+		unsigned done = 0;
+		for (; reserved; reserved &= reserved - 1)
+		{
+			unsigned pos = __builtin_ctz(reserved);
+			memcpy(dst, block + done, pos - done);
+			dst += pos - done;
+			unsigned char c = block[pos];
+			*dst++ = '%';
+			*dst++ = hex_digits[c >> 4];
+			*dst++ = hex_digits[c & 15];
+			done = pos + 1;
+		}
+		memcpy(dst, block + done, 16 - done);
+		dst += 16 - done;
+		i += 16;
+	}
+#	endif // __SSE2__
+	for (; i < length; i++)
+	{
+		unsigned char c = str[i];
+		if (IsUnreserved(c))
+			*dst++ = c;
+		else
+		{
+			*dst++ = '%';
+			*dst++ = hex_digits[c >> 4];
+			*dst++ = hex_digits[c & 15];
+		}
+	}
+	out.resize(dst - out.data());
+}
+
+void AppendEscaped(std::string &out, const std::string &str)
+{
+	AppendEscaped(out, str.data(), str.length());
+}
+
 std::string md5sum(const std::string &s)
 {
 	unsigned char md_value[EVP_MAX_MD_SIZE];
@@ -134,15 +208,23 @@ std::string md5sum(const std::string &s)
 
 std::string DateTime()
 {
-	static char result[32];
+	// worker thread may log too
+	char result[32];
 	time_t raw;
-	tm *t;
+	tm t;
 	time(&raw);
-	t = localtime(&raw);
-	result[strftime(result, 31, "%Y/%m/%d %X", t)] = 0;
+	localtime_r(&raw, &t);
+	result[strftime(result, 31, "%Y/%m/%d %X", &t)] = 0;
 	return result;
 }
 
+double CurrentTime()
+{
+	timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec/1e6;
+}
+
 int StrToInt(const std::string &s)
 {
 	return atoi(s.c_str());
@@ -32,14 +32,17 @@ void ChangeToUser();
 
 bool Daemonize();
 
-void WriteCache(const std::string &);
 void Log(LogLevel ll, const char *, ...);
 
 void IgnoreNewlines(std::string &);
 
+void AppendEscaped(std::string &, const char *, size_t);
+void AppendEscaped(std::string &, const std::string &);
+
 std::string md5sum(const std::string &);
 
 std::string DateTime();
+double CurrentTime();
 
 int StrToInt(const std::string &);
 
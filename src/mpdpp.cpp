@@ -18,66 +18,363 @@
  *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
  ***************************************************************************/
 
+#include <cstdlib>
+#include <cstring>
+#include <sys/time.h>
+
 #include "mpdpp.h"
 
 using std::string;
 
+namespace
+{
+	// idle is interrupted this often (in seconds) to check that mpd still
+	// answers, connection that died without a word would be idle forever
+	const int idle_ping_interval = 60;
+	
+	long MsecsSince(const timeval &start)
+	{
+		timeval now;
+		gettimeofday(&now, 0);
+		return (now.tv_sec-start.tv_sec)*1000 + (now.tv_usec-start.tv_usec)/1000;
+	}
+	
+	MPD::StatusChanges StatusDiff(const mpd_Status *o, const mpd_Status *n)
+	{
+		if (!o)
+			return MPD::scAll;
+		
+		MPD::StatusChanges changes = 0;
+		if (o->volume != n->volume)
+			changes |= MPD::scVolume;
+		if (o->repeat != n->repeat)
+			changes |= MPD::scRepeat;
+		if (o->random != n->random)
+			changes |= MPD::scRandom;
+		if (o->playlist != n->playlist)
+			changes |= MPD::scPlaylist;
+		if (o->playlistLength != n->playlistLength)
+			changes |= MPD::scPlaylistLength;
+		if (o->state != n->state)
+			changes |= MPD::scState;
+		if (o->crossfade != n->crossfade)
+			changes |= MPD::scCrossfade;
+		if (o->song != n->song)
+			changes |= MPD::scSong;
+		if (o->songid != n->songid)
+			changes |= MPD::scSongID;
+		if (o->elapsedTime != n->elapsedTime)
+			changes |= MPD::scElapsedTime;
+		if (o->totalTime != n->totalTime)
+			changes |= MPD::scTotalTime;
+		if (o->bitRate != n->bitRate)
+			changes |= MPD::scBitRate;
+		if (o->sampleRate != n->sampleRate || o->bits != n->bits || o->channels != n->channels)
+			changes |= MPD::scAudioFormat;
+		if (o->updatingDb != n->updatingDb)
+			changes |= MPD::scUpdatingDB;
+		if (!o->error != !n->error || (o->error && strcmp(o->error, n->error)))
+			changes |= MPD::scError;
+		return changes;
+	}
+}
+
 MPD::Connection::Connection() : isConnected(0),
+				 isConnecting(0),
+				 itsReactor(0),
+				 itsWatchedFD(-1),
+				 itsRequest(rqNone),
+				 isIdleCancelled(0),
+				 isStatusWanted(0),
+				 isSongRequested(0),
 				 itsErrorCode(0),
 				 itsHost("localhost"),
 				 itsPort(6600),
 				 itsTimeout(15),
+				 itsBufferLimit(MPD_BUFFER_MAX_LENGTH),
 				 itsUpdater(0),
-				 itsErrorHandler(0)
+				 itsErrorHandler(0),
+				 itsConnectHandler(0)
 {
 	itsConnection = 0;
+	itsStatusSlots[0].error = 0;
+	itsStatusSlots[1].error = 0;
 	itsCurrentStatus = 0;
 	itsOldStatus = 0;
+	itsCurrentSong = 0;
 }
 
 MPD::Connection::~Connection()
 {
 	if (itsConnection)
 		mpd_closeConnection(itsConnection);
-	if (itsOldStatus)
-		mpd_freeStatus(itsOldStatus);
-	if (itsCurrentStatus)
-		mpd_freeStatus(itsCurrentStatus);
+	if (itsCurrentSong)
+		mpd_freeSong(itsCurrentSong);
+	mpd_clearStatus(&itsStatusSlots[0]);
+	mpd_clearStatus(&itsStatusSlots[1]);
+}
+
+void MPD::Connection::Connect()
+{
+	if (isConnected || itsConnection)
+		return;
+	itsConnection = mpd_beginConnection(itsHost.c_str(), itsPort, itsTimeout);
+	isConnecting = 1;
+	gettimeofday(&itsConnectStart, 0);
+	Proceed();
+}
+
+bool MPD::Connection::Connected() const
+{
+	return isConnected;
 }
 
-bool MPD::Connection::Connect()
+int MPD::Connection::GetTimeout() const
 {
-	if (!isConnected && !itsConnection)
+	long left;
+	if (isConnecting)
 	{
-		itsConnection = mpd_newConnection(itsHost.c_str(), itsPort, itsTimeout);
-		isConnected = 1;
-		if (CheckForErrors())
-			return false;
-		if (!itsPassword.empty())
-			SendPassword();
-		return !CheckForErrors();
+		// mpd_continueConnection keeps track of time until welcome message
+		// is read, password is checked afterwards
+		if (itsRequest != rqPassword)
+			return mpd_getConnectingTimeout(itsConnection);
+		left = itsTimeout*1000-MsecsSince(itsConnectStart);
 	}
+	else if (isConnected && itsRequest == rqIdle && !isIdleCancelled)
+		left = idle_ping_interval*1000-MsecsSince(itsRequestStart);
+	else if (isConnected && itsRequest != rqNone)
+		left = itsTimeout*1000-MsecsSince(itsRequestStart);
 	else
-		return true;
+		return -1;
+	return left > 0 ? left : 0;
 }
 
-bool MPD::Connection::Connected() const
+void MPD::Connection::CheckTimeout()
 {
-	return isConnected;
+	if ((!isConnecting && !isConnected) || GetTimeout() != 0)
+		return;
+	if (isConnecting && itsRequest != rqPassword)
+	{
+		Proceed();
+		return;
+	}
+	if (isConnected && itsRequest == rqIdle && !isIdleCancelled)
+	{
+		// mpd answers noidle by finishing idle, which is then started again
+		mpd_sendNoIdleCommand(itsConnection);
+		isIdleCancelled = 1;
+		gettimeofday(&itsRequestStart, 0);
+		CheckForErrors();
+		return;
+	}
+	itsErrorMessage = isConnecting ? "timeout in attempting to get a response to password" : "timeout in attempting to get a response from mpd";
+	itsErrorCode = MPD_ERROR_TIMEOUT;
+	if (itsErrorHandler)
+		itsErrorHandler(this, itsErrorCode, itsErrorMessage, itsErrorHandlerUserdata);
+	Disconnect();
 }
 
 void MPD::Connection::Disconnect()
 {
+	bool had_status = itsCurrentStatus;
+	bool was_connecting = isConnecting;
+	// fd number can be reused as soon as it's closed
+	Unwatch();
+	if (itsReactor && itsWatchedFD >= 0)
+		itsReactor->Remove(itsWatchedFD);
+	itsWatchedFD = -1;
 	if (itsConnection)
 		mpd_closeConnection(itsConnection);
-	if (itsOldStatus)
-		mpd_freeStatus(itsOldStatus);
-	if (itsCurrentStatus)
-		mpd_freeStatus(itsCurrentStatus);
+	if (itsCurrentSong)
+		mpd_freeSong(itsCurrentSong);
 	itsConnection = 0;
 	itsCurrentStatus = 0;
 	itsOldStatus = 0;
+	itsCurrentSong = 0;
 	isConnected = 0;
+	isConnecting = 0;
+	itsRequest = rqNone;
+	isIdleCancelled = 0;
+	isStatusWanted = 0;
+	isSongRequested = 0;
+	// state is unknown from now on, so that time spent disconnected
+	// isn't taken for playback
+	if (had_status && itsUpdater)
+		itsUpdater(this, scState, itsStatusUpdaterUserdata);
+	if (was_connecting && itsConnectHandler)
+		itsConnectHandler(this, false, itsConnectHandlerUserdata);
+}
+
+bool MPD::Connection::SupportsIdle() const
+{
+	return itsConnection && (itsConnection->version[0] > 0 || itsConnection->version[1] >= 14);
+}
+
+void MPD::Connection::Attach(Reactor *reactor)
+{
+	itsReactor = reactor;
+}
+
+void MPD::Connection::Ready(int, int, void *data)
+{
+	Connection *c = static_cast<Connection *>(data);
+	if (c->isConnecting && c->itsRequest != rqPassword)
+		c->Proceed();
+	else
+		c->Feed();
+}
+
+void MPD::Connection::Proceed()
+{
+	// sockets can be closed and their numbers reused by the next step,
+	// so they are watched anew after each one
+	Unwatch();
+	int result = mpd_continueConnection(itsConnection);
+	if (result == 0)
+	{
+		int socks[MPD_CONNECT_MAX_SOCKETS], write;
+		int n = mpd_getConnectingSockets(itsConnection, socks, &write);
+		for (int i = 0; itsReactor && i < n; i++)
+		{
+			if (itsReactor->Add(socks[i], write ? ioWrite : ioRead, Ready, this))
+				itsConnectingFDs.push_back(socks[i]);
+		}
+		return;
+	}
+	if (result < 0)
+	{
+		CheckForErrors(); // it's fatal, so connection is closed
+		return;
+	}
+	mpd_setBufferLimit(itsConnection, itsBufferLimit);
+	if (!itsPassword.empty())
+	{
+		// answer is read by Feed() like any other response
+		mpd_sendPasswordCommand(itsConnection, itsPassword.c_str());
+		if (CheckForErrors())
+		{
+			if (itsConnection)
+				Disconnect();
+			return;
+		}
+		itsRequest = rqPassword;
+		Watch();
+		return;
+	}
+	Watch();
+	FinishConnecting();
+}
+
+void MPD::Connection::FinishConnecting()
+{
+	isConnecting = 0;
+	isConnected = 1;
+	if (itsConnectHandler)
+		itsConnectHandler(this, true, itsConnectHandlerUserdata);
+}
+
+void MPD::Connection::Unwatch()
+{
+	for (std::vector<int>::const_iterator it = itsConnectingFDs.begin(); it != itsConnectingFDs.end(); it++)
+		itsReactor->Remove(*it);
+	itsConnectingFDs.clear();
+}
+
+int MPD::Connection::GetInterest() const
+{
+	return itsConnection && itsRequest != rqNone ? ioRead : ioNone;
+}
+
+void MPD::Connection::Watch()
+{
+	if (!itsReactor || !itsConnection)
+		return;
+	if (itsWatchedFD < 0)
+	{
+		itsWatchedFD = itsConnection->sock;
+		itsReactor->Add(itsWatchedFD, GetInterest(), Ready, this);
+	}
+	else
+		itsReactor->Modify(itsWatchedFD, GetInterest());
+}
+
+void MPD::Connection::Feed()
+{
+	if (!itsConnection)
+		return;
+	
+	mpd_recvAvailable(itsConnection);
+	if (CheckForErrors())
+		return;
+	
+	while (itsConnection && itsRequest != rqNone && mpd_responseComplete(itsConnection))
+	{
+		Request finished = itsRequest;
+		itsRequest = rqNone;
+		if (finished == rqPassword)
+		{
+			mpd_finishCommand(itsConnection);
+			if (CheckForErrors())
+			{
+				// wrong password isn't fatal to connection itself
+				if (itsConnection)
+					Disconnect();
+				return;
+			}
+			FinishConnecting();
+		}
+		else if (finished == rqIdle)
+		{
+			int events = mpd_getIdleEvents(itsConnection);
+			if (CheckForErrors())
+				break;
+			// playing song can change only with these events
+			if (events || isStatusWanted)
+				SendStatusCommand(events & (MPD_IDLE_PLAYER | MPD_IDLE_PLAYLIST));
+			else
+				StartIdle();
+		}
+		else if (finished == rqStatus)
+		{
+			ReadStatus();
+			if (itsConnection && itsRequest == rqNone)
+				StartIdle();
+		}
+	}
+	Watch();
+}
+
+void MPD::Connection::StartIdle()
+{
+	// mpd < 0.14 has no idle command, so it has to be polled instead
+	if (!SupportsIdle())
+		return;
+	mpd_sendIdleCommand(itsConnection, MPD_IDLE_PLAYER | MPD_IDLE_PLAYLIST | MPD_IDLE_OPTIONS);
+	if (CheckForErrors())
+		return;
+	itsRequest = rqIdle;
+	isIdleCancelled = 0;
+	gettimeofday(&itsRequestStart, 0);
+}
+
+void MPD::Connection::SendStatusCommand(bool with_song)
+{
+	isStatusWanted = 0;
+	isSongRequested = with_song;
+	if (with_song)
+	{
+		// pipeline both commands so they cost only one round trip
+		mpd_sendCommandListOkBegin(itsConnection);
+		mpd_sendStatusCommand(itsConnection);
+		mpd_sendCurrentSongCommand(itsConnection);
+		mpd_sendCommandListEnd(itsConnection);
+	}
+	else
+		mpd_sendStatusCommand(itsConnection);
+	if (CheckForErrors())
+		return;
+	itsRequest = rqStatus;
+	gettimeofday(&itsRequestStart, 0);
 }
 
 void MPD::Connection::SetHostname(const string &host)
@@ -92,12 +389,6 @@ void MPD::Connection::SetHostname(const string &host)
 		itsHost = host;
 }
 
-void MPD::Connection::SendPassword() const
-{
-	mpd_sendPasswordCommand(itsConnection, itsPassword.c_str());
-	mpd_finishCommand(itsConnection);
-}
-
 void MPD::Connection::SetStatusUpdater(StatusUpdater updater, void *data)
 {
 	itsUpdater = updater;
@@ -110,6 +401,12 @@ void MPD::Connection::SetErrorHandler(ErrorHandler handler, void *data)
 	itsErrorHandlerUserdata = data;
 }
 
+void MPD::Connection::SetConnectHandler(ConnectHandler handler, void *data)
+{
+	itsConnectHandler = handler;
+	itsConnectHandlerUserdata = data;
+}
+
 void MPD::Connection::UpdateStatus()
 {
 	if (!itsConnection)
@@ -120,54 +417,59 @@ void MPD::Connection::UpdateStatus()
 	if (!itsConnection)
 		return;
 	
-	if (itsOldStatus)
-		mpd_freeStatus(itsOldStatus);
+	if (itsRequest == rqIdle)
+	{
+		// status will be requested as soon as idle is finished
+		if (!isIdleCancelled)
+		{
+			mpd_sendNoIdleCommand(itsConnection);
+			isIdleCancelled = 1;
+			gettimeofday(&itsRequestStart, 0);
+		}
+		isStatusWanted = 1;
+		CheckForErrors();
+	}
+	else if (itsRequest == rqNone)
+	{
+		// without idle we don't know whether song changed, so always ask
+		SendStatusCommand(!itsCurrentStatus || !SupportsIdle());
+	}
+	Watch();
+}
+
+void MPD::Connection::ReadStatus()
+{
+	// parse into the slot that doesn't hold current status, old one is
+	// not needed anymore after that
+	mpd_Status *next = itsCurrentStatus == &itsStatusSlots[0] ? &itsStatusSlots[1] : &itsStatusSlots[0];
 	
 	itsOldStatus = itsCurrentStatus;
-	itsCurrentStatus = 0;
+	itsCurrentStatus = mpd_getStatusInto(itsConnection, next) < 0 ? 0 : next;
 	
-	mpd_sendStatusCommand(itsConnection);
-	itsCurrentStatus = mpd_getStatus(itsConnection);
+	if (isSongRequested)
+	{
+		isSongRequested = 0;
+		if (itsCurrentSong)
+			mpd_freeSong(itsCurrentSong);
+		itsCurrentSong = 0;
+		// song is parsed in place, only the copy that's kept is allocated
+		mpd_Song song;
+		if (mpd_nextListOkCommand(itsConnection) == 0 && mpd_getSongView(itsConnection, &song) == 0)
+			itsCurrentSong = mpd_songDup(&song);
+		mpd_finishCommand(itsConnection);
+	}
 	
 	if (CheckForErrors())
 		return;
 	
 	if (itsCurrentStatus && itsUpdater)
-	{
-		if (itsOldStatus == NULL)
-		{
-			itsChanges.Playlist = 1;
-			itsChanges.SongID = 1;
-			itsChanges.ElapsedTime = 1;
-			itsChanges.State = 1;
-		}
-		else
-		{
-			itsChanges.Playlist = itsOldStatus->playlist != itsCurrentStatus->playlist;
-			itsChanges.SongID = itsOldStatus->songid != itsCurrentStatus->songid;
-			itsChanges.ElapsedTime = itsOldStatus->elapsedTime != itsCurrentStatus->elapsedTime;
-			itsChanges.State = itsOldStatus->state != itsCurrentStatus->state;
-		}
-		itsUpdater(this, itsChanges, itsErrorHandlerUserdata);
-	}
+		itsUpdater(this, StatusDiff(itsOldStatus, itsCurrentStatus), itsErrorHandlerUserdata);
 }
 
 mpd_Song * MPD::Connection::CurrentSong() const
 {
-	if (isConnected && (GetState() == psPlay || GetState() == psPause))
-	{
-		mpd_sendCurrentSongCommand(itsConnection);
-		mpd_InfoEntity *item = NULL;
-		item = mpd_getNextInfoEntity(itsConnection);
-		if (item)
-		{
-			mpd_Song *result = item->info.song;
-			item->info.song = 0;
-			mpd_freeInfoEntity(item);
-			return result;
-		}
-		mpd_finishCommand(itsConnection);
-	}
+	if (isConnected && itsCurrentSong && (GetState() == psPlay || GetState() == psPause))
+		return mpd_songDup(itsCurrentSong);
 	return NULL;
 }
 
@@ -22,44 +22,83 @@
 #define _MPDPP_H
 
 #include <string>
+#include <sys/time.h>
+#include <vector>
+
 #include "libmpdclient.h"
+#include "reactor.h"
 
 namespace MPD
 {
 	enum State { psUnknown, psStop, psPlay, psPause };
 	
-	struct StatusChanges
+	enum StatusChange
 	{
-		bool Playlist;
-		bool SongID;
-		bool ElapsedTime;
-		bool State;
+		scVolume = 1 << 0,
+		scRepeat = 1 << 1,
+		scRandom = 1 << 2,
+		scPlaylist = 1 << 3,
+		scPlaylistLength = 1 << 4,
+		scState = 1 << 5,
+		scCrossfade = 1 << 6,
+		scSong = 1 << 7,
+		scSongID = 1 << 8,
+		scElapsedTime = 1 << 9,
+		scTotalTime = 1 << 10,
+		scBitRate = 1 << 11,
+		scAudioFormat = 1 << 12,
+		scUpdatingDB = 1 << 13,
+		scError = 1 << 14,
+		scAll = (1 << 15)-1
 	};
 	
+	typedef unsigned StatusChanges;
+	
 	class Connection
 	{
 		typedef void (*StatusUpdater) (Connection *, StatusChanges, void *);
 		typedef void (*ErrorHandler) (Connection *, int, std::string, void *);
+		typedef void (*ConnectHandler) (Connection *, bool, void *);
 		
 		public:
 			Connection();
 			~Connection();
 			
-			bool Connect();
+			// only starts connecting, the rest is driven by the reactor
+			// and the result is passed to connect handler (failure is
+			// also reported if connecting is cut short by Disconnect)
+			void Connect();
 			bool Connected() const;
+			bool Connecting() const { return isConnecting; }
 			void Disconnect();
 			
+			// time (in ms, -1 means none) after which connecting has to
+			// go on even if no socket is ready, mpd is given up on for not
+			// answering a command or idle is interrupted to check it's there
+			int GetTimeout() const;
+			void CheckTimeout();
+			
+			bool SupportsIdle() const;
+			
+			// socket is watched by the reactor and fed as soon as
+			// response arrives, watch is dropped before it's closed
+			void Attach(Reactor *);
+			
+			int GetFD() const { return itsConnection ? itsConnection->sock : -1; }
+			void Feed();
+			
 			const std::string & GetHostname() { return itsHost; }
 			int GetPort() { return itsPort; }
 			
 			void SetHostname(const std::string &);
 			void SetPort(int port) { itsPort = port; }
 			void SetTimeout(int timeout) { itsTimeout = timeout; }
+			void SetBufferLimit(int limit) { itsBufferLimit = limit; }
 			void SetPassword(const std::string &password) { itsPassword = password; }
-			void SendPassword() const;
 			
 			void SetStatusUpdater(StatusUpdater, void *);
 			void SetErrorHandler(ErrorHandler, void *);
+			void SetConnectHandler(ConnectHandler, void *);
 			void UpdateStatus();
 			
 			State GetState() const { return isConnected && itsCurrentStatus ? (State)itsCurrentStatus->state : psUnknown; }
@@ -73,12 +112,39 @@ namespace MPD
 			mpd_Song * CurrentSong() const;
 			
 		private:
-			int CheckForErrors();
+			enum Request { rqNone, rqPassword, rqIdle, rqStatus };
 			
-			StatusChanges itsChanges;
+			static void Ready(int, int, void *);
+			
+			void Proceed();
+			void FinishConnecting();
+			
+			int GetInterest() const;
+			void Watch();
+			void Unwatch();
+			
+			void StartIdle();
+			void SendStatusCommand(bool);
+			void ReadStatus();
+			int CheckForErrors();
 			
 			mpd_Connection *itsConnection;
 			bool isConnected;
+			bool isConnecting;
+			timeval itsConnectStart;
+			
+			Reactor *itsReactor;
+			int itsWatchedFD;
+			// sockets watched while connecting, they change with each step
+			std::vector<int> itsConnectingFDs;
+			
+			Request itsRequest;
+			// response to current request is awaited since then
+			timeval itsRequestStart;
+			// noidle was sent, so idle has to end soon
+			bool isIdleCancelled;
+			bool isStatusWanted;
+			bool isSongRequested;
 			
 			std::string itsErrorMessage;
 			int itsErrorCode;
@@ -87,14 +153,23 @@ namespace MPD
 			std::string itsPassword;
 			int itsPort;
 			int itsTimeout;
+			int itsBufferLimit;
 			
+			// two slots that are parsed in place and swapped on every update,
+			// current and old status point to them (or are null if not known)
+			mpd_Status itsStatusSlots[2];
 			mpd_Status *itsCurrentStatus;
 			mpd_Status *itsOldStatus;
 			
+			// fetched along with status whenever song could change
+			mpd_Song *itsCurrentSong;
+			
 			StatusUpdater itsUpdater;
 			void *itsStatusUpdaterUserdata;
 			ErrorHandler itsErrorHandler;
 			void *itsErrorHandlerUserdata;
+			ConnectHandler itsConnectHandler;
+			void *itsConnectHandlerUserdata;
 	};
 }
 
@@ -0,0 +1,168 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <unistd.h>
+#include <vector>
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
+
+#include "reactor.h"
+
+namespace
+{
+#	ifdef HAVE_SYS_EPOLL_H
+	unsigned ToEpoll(int events)
+	{
+		return (events & ioRead ? unsigned(EPOLLIN) : 0) | (events & ioWrite ? unsigned(EPOLLOUT) : 0);
+	}
+	
+	int FromEpoll(unsigned events)
+	{
+		// errors and hangups are reported as readiness, so that handler
+		// will notice them while reading/writing
+		int result = ioNone;
+		if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			result |= ioRead;
+		if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			result |= ioWrite;
+		return result;
+	}
+#	else
+	short ToPoll(int events)
+	{
+		return (events & ioRead ? POLLIN : 0) | (events & ioWrite ? POLLOUT : 0);
+	}
+	
+	int FromPoll(short events)
+	{
+		int result = ioNone;
+		if (events & (POLLIN | POLLERR | POLLHUP | POLLNVAL))
+			result |= ioRead;
+		if (events & (POLLOUT | POLLERR | POLLHUP | POLLNVAL))
+			result |= ioWrite;
+		return result;
+	}
+#	endif
+}
+
+Reactor::Reactor() : itsPollFD(-1)
+{
+#	ifdef HAVE_SYS_EPOLL_H
+	itsPollFD = epoll_create(16);
+#	endif
+}
+
+Reactor::~Reactor()
+{
+	if (itsPollFD >= 0)
+		close(itsPollFD);
+}
+
+bool Reactor::Add(int fd, int events, Handler handler, void *data)
+{
+	if (fd < 0 || itsWatches.find(fd) != itsWatches.end())
+		return false;
+#	ifdef HAVE_SYS_EPOLL_H
+	epoll_event ev;
+	ev.events = ToEpoll(events);
+	ev.data.fd = fd;
+	if (epoll_ctl(itsPollFD, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return false;
+#	endif
+	Watch &w = itsWatches[fd];
+	w.Events = events;
+	w.Callback = handler;
+	w.Userdata = data;
+	return true;
+}
+
+bool Reactor::Modify(int fd, int events)
+{
+	std::map<int, Watch>::iterator it = itsWatches.find(fd);
+	if (it == itsWatches.end())
+		return false;
+	if (it->second.Events == events)
+		return true;
+#	ifdef HAVE_SYS_EPOLL_H
+	epoll_event ev;
+	ev.events = ToEpoll(events);
+	ev.data.fd = fd;
+	if (epoll_ctl(itsPollFD, EPOLL_CTL_MOD, fd, &ev) < 0)
+		return false;
+#	endif
+	it->second.Events = events;
+	return true;
+}
+
+void Reactor::Remove(int fd)
+{
+	if (itsWatches.erase(fd) == 0)
+		return;
+#	ifdef HAVE_SYS_EPOLL_H
+	// fails if fd was already closed, but then kernel has dropped it anyway
+	epoll_event ev;
+	epoll_ctl(itsPollFD, EPOLL_CTL_DEL, fd, &ev);
+#	endif
+}
+
+void Reactor::Run(int timeout)
+{
+	// handlers can add or remove watches, so look each fd up again
+	// right before dispatching its events
+	std::vector< std::pair<int, int> > ready;
+	
+#	ifdef HAVE_SYS_EPOLL_H
+	epoll_event events[16];
+	int n = epoll_wait(itsPollFD, events, 16, timeout);
+	for (int i = 0; i < n; i++)
+		ready.push_back(std::make_pair(int(events[i].data.fd), FromEpoll(events[i].events)));
+#	else
+	std::vector<pollfd> fds;
+	for (std::map<int, Watch>::const_iterator it = itsWatches.begin(); it != itsWatches.end(); it++)
+	{
+		pollfd p;
+		p.fd = it->first;
+		p.events = ToPoll(it->second.Events);
+		p.revents = 0;
+		fds.push_back(p);
+	}
+	int n = poll(fds.empty() ? 0 : &fds[0], fds.size(), timeout);
+	for (size_t i = 0; n > 0 && i < fds.size(); i++)
+		if (fds[i].revents)
+			ready.push_back(std::make_pair(fds[i].fd, FromPoll(fds[i].revents)));
+#	endif
+	
+	for (size_t i = 0; i < ready.size(); i++)
+	{
+		std::map<int, Watch>::const_iterator it = itsWatches.find(ready[i].first);
+		if (it == itsWatches.end())
+			continue;
+		it->second.Callback(it->first, ready[i].second, it->second.Userdata);
+	}
+}
+
@@ -0,0 +1,59 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <map>
+
+enum IOEvent { ioNone = 0, ioRead = 1, ioWrite = 2 };
+
+class Reactor
+{
+	typedef void (*Handler) (int, int, void *);
+	
+	public:
+		Reactor();
+		~Reactor();
+		
+		bool Add(int fd, int events, Handler, void *);
+		bool Modify(int fd, int events);
+		void Remove(int fd);
+		
+		void Run(int timeout);
+		
+	private:
+		struct Watch
+		{
+			int Events;
+			Handler Callback;
+			void *Userdata;
+		};
+		
+		std::map<int, Watch> itsWatches;
+		int itsPollFD;
+};
+
+#endif
+
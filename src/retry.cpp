@@ -0,0 +1,51 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "retry.h"
+
+Retry::Retry(int base, int cap) : itsBase(base),
+				  itsCap(cap),
+				  itsFailures(0),
+				  itsDue(0)
+{
+}
+
+int Retry::Failed()
+{
+	int ceiling = itsBase;
+	for (int i = 0; i < itsFailures && ceiling < itsCap; i++)
+		ceiling *= 2;
+	ceiling = std::min(ceiling, itsCap);
+	itsFailures++;
+	
+	// full jitter, but never retry in a busy loop
+	int delay = 1 + rand() % ceiling;
+	itsDue = time(0) + delay;
+	return delay;
+}
+
+void Retry::Succeeded()
+{
+	itsFailures = 0;
+	itsDue = 0;
+}
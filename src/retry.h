@@ -0,0 +1,50 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef _RETRY_H
+#define _RETRY_H
+
+#include <ctime>
+
+/// keeps retry schedule of one target (mpd, handshake, submission).
+/// delays grow exponentially up to the cap and are fully jittered,
+/// so that many clients don't hit the server at the same time.
+class Retry
+{
+	public:
+		Retry(int base, int cap);
+		
+		bool Due(time_t now) const { return now >= itsDue; }
+		time_t When() const { return itsDue; }
+		
+		/// schedules next attempt and returns its delay in seconds
+		int Failed();
+		
+		/// target is reachable again, next attempt may happen at once
+		void Succeeded();
+		
+	private:
+		int itsBase;
+		int itsCap;
+		int itsFailures;
+		time_t itsDue;
+};
+
+#endif
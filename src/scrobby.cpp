@@ -18,37 +18,228 @@
  *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
  ***************************************************************************/
 
+#include <algorithm>
+#include <cerrno>
 #include <csignal>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <curl/curl.h>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "callback.h"
 #include "configuration.h"
+#include "http.h"
 #include "misc.h"
 #include "scrobby.h"
 #include "song.h"
 #include "mpdpp.h"
+#include "reactor.h"
+#include "retry.h"
+#include "worker.h"
 
 using std::string;
 
 Handshake myHandshake;
+HTTPClient myHTTPClient;
+Worker myWorker;
 MPD::Song s;
 
+Retry mySubmitRetry(10, 600);
+
 namespace
 {
 	time_t now = 0;
 	
+	Retry handshake_retry(10, 600);
+	Retry mpd_retry(2, 60);
+	
+	bool update_status = false;
+	
+	timeval start_time;
+	timeval connect_start;
+	bool first_submission = true;
+	
+	string SessionFile()
+	{
+		return Config.file_cache + ".session";
+	}
+	
+	// session file is written in worker, so that main loop doesn't wait
+	// for the disk. saving and forgetting go through the same worker, so
+	// they're done in order.
+	struct SessionJob
+	{
+		string File;
+		string Data;
+		int Error;
+	};
+	
+	void SaveSession(void *data)
+	{
+		SessionJob *job = static_cast<SessionJob *>(data);
+		// session replaces the old one at once, so crash in the middle
+		// can't leave torn session behind for the next start
+		string tmp = job->File + ".tmp";
+		// session id is as good as password for submissions, so keep it private
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0)
+		{
+			job->Error = errno;
+			return;
+		}
+		fchmod(fd, 0600);
+		bool result = write(fd, job->Data.c_str(), job->Data.length()) == ssize_t(job->Data.length()) && fsync(fd) == 0;
+		close(fd);
+		if (!result || rename(tmp.c_str(), job->File.c_str()) != 0)
+		{
+			job->Error = errno;
+			unlink(tmp.c_str());
+		}
+	}
+	
+	void ForgetSession(void *data)
+	{
+		SessionJob *job = static_cast<SessionJob *>(data);
+		unlink(job->File.c_str());
+	}
+	
+	void SessionJobDone(void *data)
+	{
+		SessionJob *job = static_cast<SessionJob *>(data);
+		if (job->Error)
+			Log(llWarning, "Couldn't save session: %s", strerror(job->Error));
+		delete job;
+	}
+	
 	void do_at_exit()
 	{
 		s.Submit();
 		s.ExtractQueue();
+		MPD::Song::SyncCache();
 		Log(llInfo, "Shutting down...");
 		if (remove(Config.file_pid.c_str()) != 0)
 			Log(llWarning, "Couldn't remove pid file!");
 	}
 	
+	// shortens timeout (in seconds, -1 means none) so that main loop
+	// wakes up right after ts
+	void WakeUpAt(int &timeout, time_t ts)
+	{
+		int left = std::max(int(ts-now)+1, 1);
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+	
+	void MpdConnected(MPD::Connection *Mpd, bool success, void *)
+	{
+		if (success)
+		{
+			timeval connect_end;
+			gettimeofday(&connect_end, 0);
+			Log(llInfo, "Connected to MPD at %s !", Config.mpd_host.c_str());
+			Log(llVerbose, "Connecting took %ld ms.", (connect_end.tv_sec-connect_start.tv_sec)*1000+(connect_end.tv_usec-connect_start.tv_usec)/1000);
+			mpd_retry.Succeeded();
+			Mpd->UpdateStatus();
+		}
+		else
+		{
+			int delay = mpd_retry.Failed();
+			Log(llError, "Cannot connect to MPD, retrying in %d seconds...", delay);
+		}
+	}
+	
+	void HandshakeReceived(CURLcode code, const string &response, void *)
+	{
+		myHandshake.Pending = 0;
+		
+		if (code != CURLE_OK)
+		{
+			Log(llError, "Error while sending handshake: %s", curl_easy_strerror(code));
+		}
+		else
+		{
+			string result = response;
+			size_t i = result.find("\n");
+			myHandshake.Status = result.substr(0, i);
+			if (myHandshake.Status != "OK")
+			{
+				if (myHandshake.Status == "BANNED")
+				{
+					Log(llError, "Ops, this version of scrobby is banned. Please update to the newest one or if it's the newest, inform me about it (electricityispower@gmail.com)");
+					exit(1);
+				}
+				else if (myHandshake.Status == "BADAUTH")
+				{
+					Log(llError, "User authentication failed. Please check username/password settings.");
+					exit(1);
+				}
+			}
+			else
+			{
+				result = result.substr(i+1);
+				i = result.find("\n");
+				myHandshake.SessionID = result.substr(0, i);
+				result = result.substr(i+1);
+				i = result.find("\n");
+				myHandshake.NowPlayingURL = result.substr(0, i);
+				result = result.substr(i+1);
+				IgnoreNewlines(result);
+				myHandshake.SubmissionURL = result;
+			}
+			if (!myHandshake.Status.empty())
+				Log(myHandshake.OK() ? llVerbose : llError, "Handshake returned %s", myHandshake.Status.c_str());
+		}
+		
+		if (myHandshake.OK())
+		{
+			Log(llInfo, "Connected to Audioscrobbler!");
+			// backlog doesn't have to wait for submission retry that was
+			// set while the service was down or the session was invalid
+			mySubmitRetry.Succeeded();
+			handshake_retry.Succeeded();
+			myHandshake.Save();
+			// pending now playing notification can be sent now
+			SendNowPlaying();
+		}
+		else
+		{
+			int delay = handshake_retry.Failed();
+			Log(llError, "Connection to Audioscrobbler refused, retrying in %d seconds...", delay);
+		}
+	}
+	
+	void QueueSent(bool success, void *)
+	{
+		if (!success && !myHandshake.OK())
+		{
+			// session was rejected, songs are sent again as soon as
+			// new handshake is done
+			Log(llInfo, "Submission will be retried after handshake.");
+		}
+		else if (!success)
+		{
+			int delay = mySubmitRetry.Failed();
+			Log(llError, "Submission failed, retrying in %d seconds...", delay);
+		}
+		else
+		{
+			mySubmitRetry.Succeeded();
+			if (first_submission)
+			{
+				timeval tv;
+				gettimeofday(&tv, 0);
+				Log(llVerbose, "First submission done %ld ms after start.", (tv.tv_sec-start_time.tv_sec)*1000+(tv.tv_usec-start_time.tv_usec)/1000);
+				first_submission = false;
+			}
+		}
+	}
+	
 	void signal_handler(int)
 	{
 		exit(0);
@@ -57,6 +248,8 @@ namespace
 
 int main(int argc, char **argv)
 {
+	gettimeofday(&start_time, 0);
+	
 	DefaultConfiguration(Config);
 	
 	if (argc > 1)
@@ -99,8 +292,15 @@ int main(int argc, char **argv)
 			std::cerr << "couldn't daemonize!\n";
 	}
 	
+	// thread has to be started after fork
+	if (!myWorker.Start())
+		Log(llVerbose, "Couldn't start worker thread, disk syncs will block the main loop.");
+	
 	MPD::Song::GetCached();
 	
+	if (myHandshake.Load())
+		Log(llVerbose, "Reusing session from previous run.");
+	
 	MPD::Connection *Mpd = new MPD::Connection;
 	
 	if (Config.mpd_host != "localhost")
@@ -109,90 +309,113 @@ int main(int argc, char **argv)
 		Mpd->SetPort(Config.mpd_port);
 	
 	Mpd->SetTimeout(Config.mpd_timeout);
+	Mpd->SetBufferLimit(Config.mpd_buffer_limit);
 	Mpd->SetStatusUpdater(ScrobbyStatusChanged, NULL);
 	Mpd->SetErrorHandler(ScrobbyErrorCallback, NULL);
+	Mpd->SetConnectHandler(MpdConnected, NULL);
 	
 	signal(SIGHUP, signal_handler);
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 	signal(SIGPIPE, SIG_IGN);
+	srand(time(0) ^ getpid());
 	
 	atexit(do_at_exit);
 	
-	int handshake_delay = 0;
-	int queue_delay = 0;
-	int mpd_delay = 0;
+	Reactor Loop;
 	
-	time_t handshake_ts = 0;
-	time_t queue_ts = 0;
-	time_t mpd_ts = 0;
+	myHTTPClient.Attach(&Loop);
+	myWorker.Attach(&Loop);
+	Mpd->Attach(&Loop);
 	
-	while (!sleep(1))
+	// play detection and submission share this loop. network transfers
+	// never stop it and disk syncs are done by worker, but a few calls
+	// can still block it for a while: writing to the log, sending a
+	// command to mpd that doesn't read its socket (up to mpd_timeout)
+	// and name lookups when libcurl or libmpdclient can't do them
+	// asynchronously.
+	while (true)
 	{
 		time(&now);
 		
-		if (now > handshake_ts && !myHandshake.OK())
+		if (handshake_retry.Due(now) && !myHandshake.OK() && !myHandshake.Pending)
 		{
 			myHandshake.Clear();
-			if (myHandshake.Send() && !myHandshake.Status.empty())
-			{
-				Log(llError, "Handshake returned %s", myHandshake.Status.c_str());
-			}
-
-			if (myHandshake.OK())
-			{
-				Log(llInfo, "Connected to Audioscrobbler!");
-				handshake_delay = 0;
-			}
-			else
-			{
-				handshake_delay += 20;
-				Log(llError, "Connection to Audioscrobbler refused, retrying in %d seconds...", handshake_delay);
-				handshake_ts = time(0)+handshake_delay;
-			}
+			myHandshake.Forget();
+			myHandshake.Send();
 		}
 		
 		if (Mpd->Connected())
 		{
-			Mpd->UpdateStatus();
+			if (update_status)
+				Mpd->UpdateStatus();
 		}
-		else if (now > mpd_ts)
+		else if (!Mpd->Connecting() && mpd_retry.Due(now))
 		{
 			s.Submit();
 			Log(llVerbose, "Connecting to MPD...");
-			if (Mpd->Connect())
-			{
-				Log(llInfo, "Connected to MPD at %s !", Config.mpd_host.c_str());
-				mpd_delay = 0;
-			}
-			else
-			{
-				mpd_delay += 10;
-				Log(llError, "Cannot connect to MPD, retrying in %d seconds...", mpd_delay);
-				mpd_ts = time(0)+mpd_delay;
-			}
+			gettimeofday(&connect_start, 0);
+			Mpd->Connect();
 		}
+		update_status = false;
 		
-		if (now > queue_ts && (!MPD::Song::SubmitQueue.empty() || !MPD::Song::Queue.empty()))
+		SendNowPlaying();
+		
+		if (mySubmitRetry.Due(now) && !MPD::Song::Submitting && !MPD::Song::Compacting && MPD::Song::HasQueued())
 		{
-			if (!MPD::Song::SendQueue())
-			{
-				queue_delay += 30;
-				Log(llError, "Submission failed, retrying in %d seconds...", queue_delay);
-				queue_ts = time(0)+queue_delay;
-			}
+			// without session songs can only be saved, submission will
+			// start as soon as handshake is done
+			if (myHandshake.OK())
+				MPD::Song::SendQueue(QueueSent, 0);
 			else
-				queue_delay = 0;
+				MPD::Song::ExtractQueue();
+		}
+		
+		// sleep until mpd reports a change, http transfer needs attention
+		// or one of retries is due
+		int timeout = update_status ? 0 : -1;
+		time(&now);
+		if (!Mpd->Connected())
+		{
+			if (!Mpd->Connecting())
+				WakeUpAt(timeout, mpd_retry.When());
+		}
+		else if (!Mpd->SupportsIdle())
+		{
+			// mpd < 0.14 has to be polled
+			WakeUpAt(timeout, now);
+			update_status = true;
 		}
+		if (!myHandshake.OK() && !myHandshake.Pending)
+			WakeUpAt(timeout, handshake_retry.When());
+		if (myHandshake.OK() && !MPD::Song::Submitting && !MPD::Song::Compacting && MPD::Song::HasQueued())
+			WakeUpAt(timeout, mySubmitRetry.When());
+		
+		int timeout_ms = timeout < 0 ? -1 : timeout*1000;
+		int http_timeout = myHTTPClient.GetTimeout();
+		if (http_timeout >= 0 && (timeout_ms < 0 || http_timeout < timeout_ms))
+			timeout_ms = http_timeout;
+		int mpd_timeout = Mpd->GetTimeout();
+		if (mpd_timeout >= 0 && (timeout_ms < 0 || mpd_timeout < timeout_ms))
+			timeout_ms = mpd_timeout;
+		int now_playing_timeout = NowPlayingTimeout();
+		if (now_playing_timeout >= 0 && (timeout_ms < 0 || now_playing_timeout < timeout_ms))
+			timeout_ms = now_playing_timeout;
+		int cache_timeout = MPD::Song::GetCacheTimeout();
+		if (cache_timeout >= 0 && (timeout_ms < 0 || cache_timeout < timeout_ms))
+			timeout_ms = cache_timeout;
+		
+		Loop.Run(timeout_ms);
+		myHTTPClient.CheckTimeout();
+		Mpd->CheckTimeout();
+		MPD::Song::CheckCacheTimeout();
 	}
 	return 0;
 }
 
-bool Handshake::Send()
+void Handshake::Send()
 {
-	CURLcode code;
 	string handshake_url;
-	string result;
 	string timestamp = IntoStr(time(NULL));
 	
 	handshake_url = "http://post.audioscrobbler.com/?hs=true&p=1.2.1&c=mpc&v="VERSION"&u=";
@@ -202,49 +425,41 @@ bool Handshake::Send()
 	handshake_url += "&a=";
 	handshake_url += md5sum((Config.lastfm_md5_password.empty() ? md5sum(Config.lastfm_password) : Config.lastfm_md5_password) + timestamp);
 	
-	CURL *hs = curl_easy_init();
-	curl_easy_setopt(hs, CURLOPT_URL, handshake_url.c_str());
-	curl_easy_setopt(hs, CURLOPT_WRITEFUNCTION, write_data);
-	curl_easy_setopt(hs, CURLOPT_WRITEDATA, &result);
-	curl_easy_setopt(hs, CURLOPT_CONNECTTIMEOUT, curl_connecttimeout);
-	curl_easy_setopt(hs, CURLOPT_TIMEOUT, curl_timeout);
-	curl_easy_setopt(hs, CURLOPT_DNS_CACHE_TIMEOUT, 0);
-	curl_easy_setopt(hs, CURLOPT_NOPROGRESS, 1);
-	curl_easy_setopt(hs, CURLOPT_NOSIGNAL, 1);
-	code = curl_easy_perform(hs);
-	curl_easy_cleanup(hs);
-	
-	if (code != CURLE_OK)
-	{
-		Log(llError, "Error while sending handshake: %s", curl_easy_strerror(code));
+	Pending = 1;
+	myHTTPClient.Get(handshake_url, curl_connecttimeout, curl_timeout, HandshakeReceived, 0);
+}
+
+bool Handshake::Load()
+{
+	std::ifstream f(SessionFile().c_str());
+	string user;
+	std::getline(f, user);
+	std::getline(f, SessionID);
+	std::getline(f, NowPlayingURL);
+	std::getline(f, SubmissionURL);
+	// session belongs to the user it was obtained for
+	if (!f || user != Config.lastfm_user || SessionID.empty())
+	{
+		Clear();
 		return false;
 	}
-	
-	size_t i = result.find("\n");
-	Status = result.substr(0, i);
-	if (Status != "OK")
-	{
-		if (Status == "BANNED")
-		{
-			Log(llError, "Ops, this version of scrobby is banned. Please update to the newest one or if it's the newest, inform me about it (electricityispower@gmail.com)");
-		}
-		else if (Status == "BADAUTH")
-		{
-			Log(llError, "User authentication failed. Please check username/password settings.");
-		}
-		else
-			return false;
-		exit(1);
-	}
-	result = result.substr(i+1);
-	i = result.find("\n");
-	SessionID = result.substr(0, i);
-	result = result.substr(i+1);
-	i = result.find("\n");
-	NowPlayingURL = result.substr(0, i);
-	result = result.substr(i+1);
-	IgnoreNewlines(result);
-	SubmissionURL = result;
+	Status = "OK";
 	return true;
 }
 
+void Handshake::Save()
+{
+	SessionJob *job = new SessionJob;
+	job->File = SessionFile();
+	job->Data = Config.lastfm_user + "\n" + SessionID + "\n" + NowPlayingURL + "\n" + SubmissionURL + "\n";
+	job->Error = 0;
+	myWorker.Post(SaveSession, SessionJobDone, job);
+}
+
+void Handshake::Forget()
+{
+	SessionJob *job = new SessionJob;
+	job->File = SessionFile();
+	job->Error = 0;
+	myWorker.Post(ForgetSession, SessionJobDone, job);
+}
@@ -31,6 +31,12 @@ const int curl_timeout = 10;
 const int curl_queue_connecttimeout = 30;
 const int curl_queue_timeout = 60;
 
+// audioscrobbler accepts at most 50 songs in one submission
+const size_t queue_batch_size = 50;
+
+// cache is compacted once that many bytes of it were accepted
+const long long cache_compact_size = 1 << 16;
+
 struct Handshake
 {
 	void Clear()
@@ -43,7 +49,16 @@ struct Handshake
 	
 	bool OK() { return Status == "OK"; }
 	
-	bool Send();
+	void Send();
+	
+	// session is kept between runs, so that restart doesn't have to
+	// wait for handshake before anything can be sent
+	bool Load();
+	void Save();
+	void Forget();
+	
+	// set while the request is on its way
+	bool Pending;
 	
 	std::string Status;
 	std::string SessionID;
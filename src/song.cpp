@@ -19,24 +19,200 @@
  ***************************************************************************/
 
 #include <curl/curl.h>
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
-#include <fstream>
 #include <string>
 
 #include "callback.h"
+#include "http.h"
+#include "journal.h"
 #include "misc.h"
 #include "scrobby.h"
 #include "song.h"
+#include "worker.h"
 
 using std::string;
 
 extern Handshake myHandshake;
+extern HTTPClient myHTTPClient;
+extern Worker myWorker;
 extern MPD::Song s;
 
+namespace
+{
+	void AppendField(string &out, char key, size_t index, const string &value)
+	{
+		out += '&';
+		out += key;
+		out += '[';
+		out += IntoStr(index);
+		out += "]=";
+		AppendEscaped(out, value);
+	}
+	
+	// cache fields are separated by tabs, so tabs, newlines and
+	// backslashes in values are escaped with backslash
+	void AppendCacheField(string &out, const string &str)
+	{
+		if (!out.empty())
+			out += '\t';
+		for (string::const_iterator it = str.begin(); it != str.end(); it++)
+		{
+			if (*it == '\t')
+				out += "\\t";
+			else if (*it == '\n')
+				out += "\\n";
+			else if (*it == '\\')
+				out += "\\\\";
+			else
+				out += *it;
+		}
+	}
+	
+	std::vector<string> SplitCacheLine(const string &line)
+	{
+		std::vector<string> fields(1);
+		for (size_t i = 0; i < line.length(); i++)
+		{
+			if (line[i] == '\t')
+				fields.push_back("");
+			else if (line[i] == '\\' && i+1 < line.length())
+			{
+				i++;
+				fields.back() += line[i] == 't' ? '\t' : line[i] == 'n' ? '\n' : line[i];
+			}
+			else
+				fields.back() += line[i];
+		}
+		return fields;
+	}
+	
+	// approximate memory taken by a song waiting in the queue
+	size_t Footprint(const MPD::Scrobble &sc)
+	{
+		return sizeof(sc) + sc.Artist.capacity() + sc.Title.capacity() + sc.Album.capacity() + sc.Track.capacity() + sc.MBID.capacity();
+	}
+	
+	// compaction runs in worker, then the journal is reopened
+	struct Compaction
+	{
+		string File;
+		std::vector<string> Records;
+		std::vector<long long> Offsets;
+		bool Result;
+		int Error;
+	};
+	
+	void RunCompaction(void *data)
+	{
+		Compaction *c = static_cast<Compaction *>(data);
+		c->Result = JournalRewrite(c->File, c->Records, c->Offsets);
+		c->Error = errno;
+	}
+	
+	string Unescaped(const string &str)
+	{
+		int length;
+		char *c_str = curl_easy_unescape(0, str.c_str(), str.length(), &length);
+		string result(c_str, length);
+		curl_free(c_str);
+		return result;
+	}
+}
+
+string MPD::Scrobble::ToCache() const
+{
+	string result;
+	AppendCacheField(result, IntoStr(StartTime));
+	AppendCacheField(result, IntoStr(Length));
+	AppendCacheField(result, Artist);
+	AppendCacheField(result, Title);
+	AppendCacheField(result, Album);
+	AppendCacheField(result, Track);
+	AppendCacheField(result, MBID);
+	return result;
+}
+
+bool MPD::Scrobble::FromCache(const string &line)
+{
+	if (line.empty())
+		return false;
+	
+	// caches written by older versions hold ready query strings
+	if (line[0] == '&')
+	{
+		size_t pos = 0;
+		while (pos < line.length())
+		{
+			size_t end = line.find('&', pos+1);
+			if (end == string::npos)
+				end = line.length();
+			size_t eq = line.find("]=", pos);
+			if (eq < end && pos+1 < end)
+			{
+				string value = Unescaped(line.substr(eq+2, end-eq-2));
+				switch (line[pos+1])
+				{
+					case 'a': Artist = value; break;
+					case 't': Title = value; break;
+					case 'i': StartTime = StrToInt(value); break;
+					case 'l': Length = StrToInt(value); break;
+					case 'b': Album = value; break;
+					case 'n': Track = value; break;
+					case 'm': MBID = value; break;
+				}
+			}
+			pos = end;
+		}
+		return !Artist.empty() && !Title.empty();
+	}
+	
+	std::vector<string> fields = SplitCacheLine(line);
+	if (fields.size() < 7)
+		return false;
+	StartTime = StrToInt(fields[0]);
+	Length = StrToInt(fields[1]);
+	Artist = fields[2];
+	Title = fields[3];
+	Album = fields[4];
+	Track = fields[5];
+	MBID = fields[6];
+	return true;
+}
+
+void MPD::Scrobble::Encode(string &out, size_t index) const
+{
+	AppendField(out, 'a', index, Artist);
+	AppendField(out, 't', index, Title);
+	AppendField(out, 'i', index, IntoStr(StartTime));
+	AppendField(out, 'o', index, "P");
+	AppendField(out, 'r', index, "");
+	AppendField(out, 'l', index, IntoStr(Length));
+	AppendField(out, 'b', index, Album);
+	AppendField(out, 'n', index, Track);
+	AppendField(out, 'm', index, MBID);
+}
+
 bool MPD::Song::NowPlayingNotify = 0;
+bool MPD::Song::Submitting = 0;
+bool MPD::Song::Compacting = 0;
 
-std::deque<std::string> MPD::Song::SubmitQueue;
-std::queue<MPD::Song> MPD::Song::Queue;
+MPD::Song::QueueSent MPD::Song::itsQueueSent = 0;
+void *MPD::Song::itsQueueSentUserdata = 0;
+
+std::list<MPD::Song::Batch> MPD::Song::itsBatches;
+std::vector<MPD::Song::Batch> MPD::Song::itsFailedBatches;
+unsigned MPD::Song::itsBatchCounter = 0;
+unsigned MPD::Song::itsSubmittedCount = 0;
+double MPD::Song::itsDrainStart = 0;
+long long MPD::Song::itsAckedOffset = 0;
+bool MPD::Song::isCacheDamaged = 0;
+JournalReader MPD::Song::itsBacklog;
+JournalWriter MPD::Song::itsCache;
+
+std::deque<MPD::Scrobble> MPD::Song::SubmitQueue;
+std::deque<MPD::Scrobble> MPD::Song::Queue;
 
 MPD::Song::Song() : Data(0),
 		    StartTime(0),
@@ -81,9 +257,23 @@ void MPD::Song::Submit()
 	
 	if (canBeSubmitted())
 	{
-		Queue.push(*this);
-		Data = 0;
+		// hand over plain record, so that the song itself can be
+		// released right away and submission doesn't depend on it
+		Scrobble sc;
+		sc.Artist = Data->artist;
+		sc.Title = Data->title;
+		if (Data->album)
+			sc.Album = Data->album;
+		if (Data->track)
+			sc.Track = Data->track;
+		if (Data->musicbrainz_trackid)
+			sc.MBID = Data->musicbrainz_trackid;
+		sc.StartTime = StartTime;
+		sc.Length = Data->time;
+		Queue.push_back(sc);
 		Log(llInfo, "Song queued for submission.");
+		// song goes to the journal at once, even if a drain is running
+		ExtractQueue();
 	}
 	Clear();
 }
@@ -126,109 +316,201 @@ bool MPD::Song::canBeSubmitted()
 
 void MPD::Song::GetCached()
 {
-	std::ifstream f(Config.file_cache.c_str());
-	if (f.is_open())
+	// songs are read from mapped journal when they're about to be sent
+	if (itsBacklog.Open(Config.file_cache))
+	{
+		itsAckedOffset = itsBacklog.GetAcked();
+	}
+	else
 	{
-		std::string line;
-		while (!f.eof())
+		std::vector<string> records;
+		std::vector<long long> offsets;
+		itsAckedOffset = JournalReplay(Config.file_cache, records, offsets);
+		for (size_t i = 0; i < records.size(); i++)
 		{
-			getline(f, line);
-			if (!line.empty())
-				SubmitQueue.push_back(line);
+			Scrobble sc;
+			if (sc.FromCache(records[i]))
+			{
+				sc.Offset = offsets[i];
+				SubmitQueue.push_back(sc);
+			}
 		}
 	}
+	
+	itsCache.SetPolicy(Config.cache_sync, Config.cache_sync_interval, Config.cache_sync_records);
+	itsCache.SetWorker(&myWorker);
+	itsCache.SetAckHandler(CacheAcked, 0);
+	if (!itsCache.Open(Config.file_cache))
+		Log(llError, "Couldn't open cache: %s", strerror(errno));
+	
+	// converted cache was read as a whole
+	SpillQueue();
 }
 
 void MPD::Song::ExtractQueue()
 {
-	for (; !Queue.empty(); Queue.pop())
+	// journal is being replaced, songs wait until it's reopened
+	if (Compacting)
+		return;
+	for (; !Queue.empty(); Queue.pop_front())
 	{
-		const MPD::Song &s = Queue.front();
-		
-		string cache_str;
-		std::ostringstream cache;
-		
-		char *c_artist = curl_easy_escape(0, s.Data->artist, 0);
-		char *c_title = curl_easy_escape(0, s.Data->title, 0);
-		char *c_album = s.Data->album ? curl_easy_escape(0, s.Data->album, 0) : 0;
-		char *c_track = s.Data->track ? curl_easy_escape(0, s.Data->track, 0) : 0;
-		char *c_mb_trackid = s.Data->musicbrainz_trackid ? curl_easy_escape(0, s.Data->musicbrainz_trackid, 0) : 0;
-		
-		cache
-		<< "&a[" << Song::SubmitQueue.size() << "]=" << c_artist
-		<< "&t[" << Song::SubmitQueue.size() << "]=" << c_title
-		<< "&i[" << Song::SubmitQueue.size() << "]=" << s.StartTime
-		<< "&o[" << Song::SubmitQueue.size() << "]=P"
-		<< "&r[" << Song::SubmitQueue.size() << "]="
-		<< "&l[" << Song::SubmitQueue.size() << "]=" << s.Data->time
-		<< "&b[" << Song::SubmitQueue.size() << "]=";
-		if (c_album)
-			cache << c_album;
-		cache << "&n[" << Song::SubmitQueue.size() << "]=";
-		if (c_track)
-			cache << c_track;
-		cache << "&m[" << Song::SubmitQueue.size() << "]=";
-		if (c_mb_trackid)
-			cache << c_mb_trackid;
-		
-		cache_str = cache.str();
-		
-		SubmitQueue.push_back(cache_str);
-		WriteCache(cache_str);
-		
-		curl_free(c_artist);
-		curl_free(c_title);
-		curl_free(c_album);
-		curl_free(c_track);
-		curl_free(c_mb_trackid);
+		Scrobble sc = Queue.front();
+		sc.Offset = itsCache.Append(sc.ToCache());
+		if (sc.Offset < 0)
+			Log(llError, "Couldn't write song to cache: %s", strerror(errno));
+		// while backlog is being read, new songs are picked up from
+		// the journal after it, so that they're sent in order
+		if (!itsBacklog.IsOpen() || sc.Offset < 0)
+			SubmitQueue.push_back(sc);
 	}
+	SpillQueue();
+}
+
+bool MPD::Song::HasQueued()
+{
+	return !Queue.empty() || !SubmitQueue.empty() || itsBacklog.IsOpen();
+}
+
+int MPD::Song::GetCacheTimeout()
+{
+	return itsCache.GetTimeout();
+}
+
+void MPD::Song::CheckCacheTimeout()
+{
+	itsCache.CheckTimeout();
+}
+
+void MPD::Song::SyncCache()
+{
+	itsCache.Flush();
 }
 
-bool MPD::Song::SendQueue()
+void MPD::Song::SendQueue(QueueSent sent, void *data)
 {
 	ExtractQueue();
 	
 	if (!myHandshake.OK())
-		return false;
-	
-	Log(llInfo, "Submitting songs...");
-	
-	string result, postdata;
-	CURLcode code;
+	{
+		sent(false, data);
+		return;
+	}
 	
-	postdata = "s=";
-	postdata += myHandshake.SessionID;
+	Submitting = 1;
+	itsQueueSent = sent;
+	itsQueueSentUserdata = data;
+	itsSubmittedCount = 0;
+	itsDrainStart = CurrentTime();
+	SendBatches();
+}
+
+void MPD::Song::FillQueue()
+{
+	// decode only as many songs from backlog as can be sent right away
+	while (itsBacklog.IsOpen() && SubmitQueue.size() < queue_batch_size*Config.queue_batches_in_flight)
+	{
+		string record;
+		long long offset;
+		if (!itsBacklog.Next(record, offset))
+		{
+			// skipped records are dropped by the next compaction
+			isCacheDamaged = itsBacklog.IsDamaged();
+			itsBacklog.Close();
+			break;
+		}
+		Scrobble sc;
+		if (sc.FromCache(record))
+		{
+			sc.Offset = offset;
+			SubmitQueue.push_back(sc);
+		}
+	}
+}
+
+void MPD::Song::SpillQueue()
+{
+	if (itsBacklog.IsOpen())
+		return;
 	
-	for (std::deque<string>::const_iterator it = Song::SubmitQueue.begin(); it != Song::SubmitQueue.end(); it++)
-		postdata += *it;
+	// songs waiting for the journal can't be moved out of memory, but
+	// they count, so that more of the others are
+	size_t memory = 0;
+	for (std::deque<Scrobble>::const_iterator it = Queue.begin(); it != Queue.end(); it++)
+		memory += Footprint(*it);
+	for (std::deque<Scrobble>::const_iterator it = SubmitQueue.begin(); it != SubmitQueue.end(); it++)
+		memory += Footprint(*it);
+	if (memory <= size_t(Config.queue_memory_limit))
+		return;
 	
-	Log(llVerbose, "URL: %s", myHandshake.SubmissionURL.c_str());
-	Log(llVerbose, "Post data: %s", postdata.c_str());
+	// songs at the end of the queue are in the journal in the same order,
+	// so they can be dropped and read from there again when needed
+	size_t keep = SubmitQueue.size();
+	while (keep > queue_batch_size*Config.queue_batches_in_flight && SubmitQueue[keep-1].Offset >= 0
+	&&     (keep == SubmitQueue.size() || SubmitQueue[keep-1].Offset < SubmitQueue[keep].Offset))
+		keep--;
+	if (keep == SubmitQueue.size() || !itsBacklog.Resume(Config.file_cache, SubmitQueue[keep].Offset))
+		return;
 	
-	CURL *submission = curl_easy_init();
-	curl_easy_setopt(submission, CURLOPT_URL, myHandshake.SubmissionURL.c_str());
-	curl_easy_setopt(submission, CURLOPT_POST, 1);
-	curl_easy_setopt(submission, CURLOPT_POSTFIELDS, postdata.c_str());
-	curl_easy_setopt(submission, CURLOPT_WRITEFUNCTION, write_data);
-	curl_easy_setopt(submission, CURLOPT_WRITEDATA, &result);
-	curl_easy_setopt(submission, CURLOPT_CONNECTTIMEOUT, curl_queue_connecttimeout);
-	curl_easy_setopt(submission, CURLOPT_TIMEOUT, curl_queue_timeout);
-	curl_easy_setopt(submission, CURLOPT_DNS_CACHE_TIMEOUT, 0);
-	curl_easy_setopt(submission, CURLOPT_NOPROGRESS, 1);
-	curl_easy_setopt(submission, CURLOPT_NOSIGNAL, 1);
-	code = curl_easy_perform(submission);
-	curl_easy_cleanup(submission);
+	Log(llVerbose, "Queue takes %u bytes, moving %u songs out of memory.", unsigned(memory), unsigned(SubmitQueue.size()-keep));
+	SubmitQueue.erase(SubmitQueue.begin()+keep, SubmitQueue.end());
+	// deque may keep its blocks otherwise
+	std::deque<Scrobble>(SubmitQueue).swap(SubmitQueue);
+}
+
+void MPD::Song::SendBatches()
+{
+	// failed batches have to go back to the queue before anything else
+	// is sent, otherwise songs would be submitted out of order. with
+	// more than one batch in flight the server can still get (or
+	// accept) a batch before the previous one, so strict chronological
+	// order is kept only with the default of one.
+	FillQueue();
+	while (itsFailedBatches.empty() && !SubmitQueue.empty() && itsBatches.size() < size_t(Config.queue_batches_in_flight))
+	{
+		itsBatches.push_back(Batch());
+		Batch &b = itsBatches.back();
+		b.Number = ++itsBatchCounter;
+		b.Done = 0;
+		
+		// encoding buffer keeps its capacity between batches
+		static string postdata;
+		postdata = "s=";
+		postdata += myHandshake.SessionID;
+		for (size_t i = 0; i < queue_batch_size && !SubmitQueue.empty(); i++)
+		{
+			b.Entries.push_back(SubmitQueue.front());
+			SubmitQueue.pop_front();
+			b.Entries.back().Encode(postdata, i);
+		}
+		FillQueue();
+		
+		Log(llInfo, "Submitting songs...");
+		Log(llVerbose, "URL: %s", myHandshake.SubmissionURL.c_str());
+		Log(llVerbose, "Post data: %s", postdata.c_str());
+		
+		myHTTPClient.Post(myHandshake.SubmissionURL, postdata, curl_queue_connecttimeout, curl_queue_timeout, BatchSubmitted, reinterpret_cast<void *>(size_t(b.Number)), Config.compress_submissions);
+	}
+	if (itsBatches.empty())
+		QueueFinished(itsFailedBatches.empty());
+}
+
+void MPD::Song::BatchSubmitted(CURLcode code, const string &response, void *data)
+{
+	unsigned number = reinterpret_cast<size_t>(data);
+	std::list<Batch>::iterator b = itsBatches.begin();
+	for (; b != itsBatches.end() && b->Number != number; b++) { }
+	if (b == itsBatches.end())
+		return;
 	
+	string result = response;
 	IgnoreNewlines(result);
 	
 	if (result == "OK")
 	{
-		Log(llInfo, "Number of submitted songs: %d", Song::SubmitQueue.size());
-		SubmitQueue.clear();
-		std::ofstream f(Config.file_cache.c_str(), std::ios::trunc);
-		f.close();
-		NowPlayingNotify = s.Data && !s.isStream();
-		return true;
+		Log(llInfo, "Number of submitted songs: %d", b->Entries.size());
+		itsSubmittedCount += b->Entries.size();
+		itsBatches.erase(b);
+		AckCache();
 	}
 	else
 	{
@@ -239,11 +521,119 @@ bool MPD::Song::SendQueue()
 		else
 		{
 			Log(llError, "Audioscrobbler returned status %s", result.c_str());
-			// BADSESSION or FAILED was returned, handshake needs resetting.
-			myHandshake.Clear();
-			Log(llVerbose, "Handshake reset");
+			// FAILED means the submission itself went wrong, only
+			// BADSESSION requires a new handshake
+			if (result == "BADSESSION" && myHandshake.OK())
+			{
+				myHandshake.Clear();
+				Log(llVerbose, "Handshake reset");
+			}
 		}
-		return false;
+		itsFailedBatches.push_back(*b);
+		itsBatches.erase(b);
 	}
+	
+	if (!itsFailedBatches.empty() && itsBatches.empty())
+	{
+		// put songs back in the order they were sent, newest batch first
+		while (!itsFailedBatches.empty())
+		{
+			std::vector<Batch>::iterator last = itsFailedBatches.begin();
+			for (std::vector<Batch>::iterator it = itsFailedBatches.begin(); it != itsFailedBatches.end(); it++)
+				if (it->Number > last->Number)
+					last = it;
+			SubmitQueue.insert(SubmitQueue.begin(), last->Entries.begin(), last->Entries.end());
+			itsFailedBatches.erase(last);
+		}
+		QueueFinished(false);
+	}
+	else if (itsFailedBatches.empty())
+		SendBatches();
+}
+
+void MPD::Song::QueueFinished(bool success)
+{
+	Submitting = 0;
+	if (itsSubmittedCount > 0)
+	{
+		double elapsed = std::max(CurrentTime()-itsDrainStart, 0.001);
+		Log(llInfo, "Submitted %u songs in %.1f seconds (%.1f tracks/s).", itsSubmittedCount, elapsed, itsSubmittedCount/elapsed);
+	}
+	if (success)
+		NowPlayingNotify = s.Data && !s.isStream();
+	CompactCache();
+	itsQueueSent(success, itsQueueSentUserdata);
+}
+
+void MPD::Song::AckCache()
+{
+	// songs that are still being sent stay in cache until they're
+	// accepted, so checkpoint can't go past the first of them
+	long long first = -1;
+	for (std::list<Batch>::const_iterator b = itsBatches.begin(); b != itsBatches.end(); b++)
+		for (std::vector<Scrobble>::const_iterator it = b->Entries.begin(); it != b->Entries.end(); it++)
+			if (it->Offset >= 0 && (first < 0 || it->Offset < first))
+				first = it->Offset;
+	for (std::vector<Batch>::const_iterator b = itsFailedBatches.begin(); b != itsFailedBatches.end(); b++)
+		for (std::vector<Scrobble>::const_iterator it = b->Entries.begin(); it != b->Entries.end(); it++)
+			if (it->Offset >= 0 && (first < 0 || it->Offset < first))
+				first = it->Offset;
+	for (std::deque<Scrobble>::const_iterator it = SubmitQueue.begin(); it != SubmitQueue.end(); it++)
+		if (it->Offset >= 0 && (first < 0 || it->Offset < first))
+			first = it->Offset;
+	
+	// songs not read from backlog yet weren't sent either
+	if (itsBacklog.IsOpen() && (first < 0 || itsBacklog.GetPosition() < first))
+		first = itsBacklog.GetPosition();
+	
+	// checkpoint that wasn't synced yet is synced again with the next
+	// records, so it doesn't have to be written again
+	if (first >= 0 && first <= std::max(itsAckedOffset, itsCache.GetCheckpoint()))
+		return;
+	if (itsCache.Ack(first) < 0)
+		Log(llError, "Couldn't write checkpoint to cache: %s", strerror(errno));
 }
 
+void MPD::Song::CacheAcked(long long offset, void *)
+{
+	itsAckedOffset = offset;
+	if (!Submitting)
+		CompactCache();
+}
+
+void MPD::Song::CompactCache()
+{
+	if ((itsAckedOffset < cache_compact_size && !isCacheDamaged) || itsBacklog.IsOpen() || Compacting)
+		return;
+	
+	// nothing is being sent now, so all waiting songs are in the queue
+	// and it doesn't change until new journal is in place
+	Compaction *c = new Compaction;
+	c->File = Config.file_cache;
+	for (std::deque<Scrobble>::const_iterator it = SubmitQueue.begin(); it != SubmitQueue.end(); it++)
+		c->Records.push_back(it->ToCache());
+	Compacting = 1;
+	myWorker.Post(RunCompaction, CompactionDone, c);
+}
+
+void MPD::Song::CompactionDone(void *data)
+{
+	Compaction *c = static_cast<Compaction *>(data);
+	Compacting = 0;
+	if (!c->Result)
+		Log(llError, "Couldn't compact cache: %s", strerror(c->Error));
+	else
+	{
+		// new journal replaced the file, so descriptor has to be reopened
+		if (!itsCache.Open(Config.file_cache))
+			Log(llError, "Couldn't open cache: %s", strerror(errno));
+		for (size_t i = 0; i < SubmitQueue.size(); i++)
+			SubmitQueue[i].Offset = c->Offsets[i];
+		itsAckedOffset = 0;
+		isCacheDamaged = 0;
+		Log(llVerbose, "Cache compacted, %u songs left in it.", unsigned(c->Records.size()));
+	}
+	delete c;
+	// songs played meanwhile can go to the journal now
+	ExtractQueue();
+}
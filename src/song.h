@@ -21,15 +21,43 @@
 #ifndef _SONG_H
 #define _SONG_H
 
-#include <queue>
+#include <curl/curl.h>
+#include <list>
 #include <deque>
+#include <string>
+#include <vector>
 
+#include "journal.h"
 #include "libmpdclient.h"
 
 namespace MPD
 {
+	/// song waiting for submission, as it's kept in the queue and cache
+	struct Scrobble
+	{
+		Scrobble() : StartTime(0), Length(0), Offset(-1) { }
+		
+		std::string ToCache() const;
+		bool FromCache(const std::string &);
+		
+		void Encode(std::string &, size_t index) const;
+		
+		std::string Artist;
+		std::string Title;
+		std::string Album;
+		std::string Track;
+		std::string MBID;
+		time_t StartTime;
+		int Length;
+		
+		// position in cache journal, -1 if it's not there
+		long long Offset;
+	};
+	
 	class Song
 	{
+		typedef void (*QueueSent) (bool, void *);
+		
 		public:
 			Song();
 			~Song();
@@ -44,17 +72,54 @@ namespace MPD
 			
 			static void GetCached();
 			static void ExtractQueue();
+			static bool HasQueued();
 			
-			static bool SendQueue();
+			static int GetCacheTimeout();
+			static void CheckCacheTimeout();
+			static void SyncCache();
+			
+			static void SendQueue(QueueSent, void *);
 			
 			static bool NowPlayingNotify;
+			static bool Submitting;
+			static bool Compacting;
 			
-			static std::queue<MPD::Song> Queue;
-			static std::deque<std::string> SubmitQueue;
+			static std::deque<Scrobble> Queue;
+			static std::deque<Scrobble> SubmitQueue;
 			
 		private:
+			struct Batch
+			{
+				unsigned Number;
+				bool Done;
+				std::vector<Scrobble> Entries;
+			};
+			
 			void Clear();
 			
+			static void FillQueue();
+			static void SpillQueue();
+			static void SendBatches();
+			static void BatchSubmitted(CURLcode, const std::string &, void *);
+			static void QueueFinished(bool);
+			static void AckCache();
+			static void CacheAcked(long long, void *);
+			static void CompactCache();
+			static void CompactionDone(void *);
+			
+			static QueueSent itsQueueSent;
+			static void *itsQueueSentUserdata;
+			
+			static std::list<Batch> itsBatches;
+			static std::vector<Batch> itsFailedBatches;
+			static unsigned itsBatchCounter;
+			static unsigned itsSubmittedCount;
+			static double itsDrainStart;
+			static long long itsAckedOffset;
+			static bool isCacheDamaged;
+			static JournalReader itsBacklog;
+			static JournalWriter itsCache;
+			
 			bool canBeSubmitted();
 			bool itsIsStream;
 	};
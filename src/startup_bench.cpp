@@ -0,0 +1,146 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+// measures how long scrobby takes from exec to its main loop with a big
+// cache of songs waiting for submission. the main loop is reached when
+// scrobby connects to mpd, which is faked here.
+// usage: startup_bench [songs] [path to scrobby]
+
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "misc.h"
+
+using std::string;
+
+namespace
+{
+	void WriteCache(const string &file, int songs)
+	{
+		std::vector<string> records;
+		std::vector<long long> offsets;
+		records.reserve(songs);
+		char record[128];
+		for (int i = 0; i < songs; i++)
+		{
+			snprintf(record, sizeof(record), "%d\t200\tArtist %d\tTitle %d\tAlbum\t%d\t", 1200000000+i, i%1000, i, i%12+1);
+			records.push_back(record);
+		}
+		JournalRewrite(file, records, offsets);
+	}
+	
+	// returns port of socket listening on loopback
+	int Listen(int &fd)
+	{
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in addr = sockaddr_in();
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t length = sizeof(addr);
+		if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), length) != 0 || listen(fd, 1) != 0
+		||  getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &length) != 0)
+			return -1;
+		return ntohs(addr.sin_port);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int songs = argc > 1 ? atoi(argv[1]) : 1000000;
+	string scrobby = argc > 2 ? argv[2] : "./scrobby";
+	
+	char dir[] = "/tmp/scrobby-bench.XXXXXX";
+	if (!mkdtemp(dir))
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+	string cache = string(dir) + "/cache";
+	string conf = string(dir) + "/conf";
+	Config.file_log = "/dev/null";
+	Config.log_level = llError;
+	
+	int listener;
+	int port = Listen(listener);
+	if (port < 0)
+	{
+		perror("listen");
+		return 1;
+	}
+	
+	WriteCache(cache, songs);
+	// saved session keeps scrobby from looking up last.fm at startup,
+	// submissions go to a port nobody listens on
+	std::ofstream(string(cache + ".session").c_str()) << "bench\nsession\nhttp://127.0.0.1:9/np\nhttp://127.0.0.1:9/submit\n";
+	std::ofstream(conf.c_str())
+	<< "mpd_host = \"127.0.0.1\"\n"
+	<< "mpd_port = \"" << port << "\"\n"
+	<< "log_file = \"" << dir << "/log\"\n"
+	<< "pid_file = \"" << dir << "/pid\"\n"
+	<< "cache_file = \"" << cache << "\"\n"
+	<< "lastfm_user = \"bench\"\n"
+	<< "lastfm_password = \"bench\"\n";
+	
+	// cache is read from page cache like it would be on a running system
+	double start = CurrentTime();
+	JournalReader r;
+	r.Open(cache);
+	r.Close();
+	double open = CurrentTime()-start;
+	
+	start = CurrentTime();
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		execl(scrobby.c_str(), "scrobby", "--no-daemon", conf.c_str(), static_cast<char *>(0));
+		_exit(127);
+	}
+	pollfd pfd = { listener, POLLIN, 0 };
+	bool connected = pid > 0 && poll(&pfd, 1, 60000) == 1;
+	double elapsed = CurrentTime()-start;
+	if (pid > 0)
+	{
+		kill(pid, SIGTERM);
+		waitpid(pid, 0, 0);
+	}
+	
+	if (connected)
+		printf("%d songs in cache: opening journal %.1f ms, exec to main loop %.1f ms\n", songs, open*1000, elapsed*1000);
+	else
+		fprintf(stderr, "scrobby didn't connect to mpd\n");
+	
+	unlink(cache.c_str());
+	unlink(string(cache + ".session").c_str());
+	unlink(conf.c_str());
+	unlink((string(dir) + "/log").c_str());
+	unlink((string(dir) + "/pid").c_str());
+	rmdir(dir);
+	return connected ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+// compares sync policies of the cache journal. songs are appended back
+// to back or with given gap through worker like scrobby does it, and for
+// each policy it shows
+// throughput, how long main loop waits for appending a song, how many
+// syncs were made and how long songs waited until they were on disk.
+// journal is put into given directory, so that it can be on a real disk.
+// usage: sync_bench [songs] [directory] [gap between songs in ms]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "misc.h"
+#include "reactor.h"
+#include "worker.h"
+
+using std::string;
+
+namespace
+{
+	const char song[] = "1700000000\t200\tArtist\tTitle\tAlbum\t1\t";
+	
+	// when songs were appended and how long they waited for sync. all
+	// records have the same length, so size of the file tells syncs
+	// running in worker how many songs they cover.
+	std::vector<double> appended_at;
+	std::vector<double> waited;
+	long long first_song = 0;
+	long long record_size = 0;
+	int synced = 0;
+	int syncs = 0;
+	
+	void MeasureRecords(const string &file)
+	{
+		unlink(file.c_str());
+		JournalWriter w;
+		w.SetPolicy(spNone, 0, 0);
+		w.Open(file);
+		first_song = w.Append(song);
+		record_size = w.Append(song)-first_song;
+		w.Close();
+		unlink(file.c_str());
+	}
+	
+	void Measure(const char *name, SyncPolicy policy, const string &file, int songs, int gap, Worker &worker)
+	{
+		unlink(file.c_str());
+		appended_at.assign(songs, 0);
+		waited.assign(songs, 0);
+		synced = 0;
+		syncs = 0;
+		
+		Reactor loop;
+		worker.Attach(&loop);
+		JournalWriter w;
+		w.SetPolicy(policy, Config.cache_sync_interval, Config.cache_sync_records);
+		w.SetWorker(&worker);
+		w.Open(file);
+		
+		double total = 0, worst = 0;
+		double start = CurrentTime();
+		for (int i = 0; i < songs; i++)
+		{
+			// main loop picks up finished syncs between songs
+			double next = CurrentTime()+gap/1000.0;
+			do
+			{
+				loop.Run(std::max(0, int((next-CurrentTime())*1000)));
+				w.CheckTimeout();
+			}
+			while (CurrentTime() < next);
+			double song_start = CurrentTime();
+			appended_at[i] = song_start;
+			w.Append(song);
+			double elapsed = CurrentTime()-song_start;
+			total += elapsed;
+			if (elapsed > worst)
+				worst = elapsed;
+		}
+		// without syncs songs are left to the kernel, so they're not
+		// flushed at the end either
+		if (policy == spNone)
+			worker.Wait();
+		else
+			w.Flush();
+		double throughput = songs/(CurrentTime()-start);
+		w.Close();
+		
+		printf("%-8s %d songs: %.0f songs/s, append avg %.3f ms, max %.3f ms, %d syncs, ",
+		       name, songs, throughput, total*1000/songs, worst*1000, syncs);
+		if (synced < songs)
+		{
+			printf("songs left to kernel\n");
+			return;
+		}
+		double sum = 0, longest = 0;
+		for (int i = 0; i < songs; i++)
+		{
+			sum += waited[i];
+			if (waited[i] > longest)
+				longest = waited[i];
+		}
+		printf("on disk after avg %.1f ms, max %.1f ms\n", sum*1000/songs, longest*1000);
+	}
+}
+
+// sync covers songs appended before it started, they're marked as being
+// on disk once it's done
+extern "C" int fdatasync(int fd)
+{
+	struct stat st;
+	int covered = fstat(fd, &st) == 0 ? (st.st_size-first_song)/record_size : 0;
+	int result = syscall(SYS_fdatasync, fd);
+	double now = CurrentTime();
+	for (; synced < covered; synced++)
+		waited[synced] = now-appended_at[synced];
+	syncs++;
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	int songs = argc > 1 ? atoi(argv[1]) : 2000;
+	string file = string(argc > 2 ? argv[2] : ".") + "/sync_bench.cache";
+	int gap = argc > 3 ? atoi(argv[3]) : 0;
+	DefaultConfiguration(Config);
+	Config.file_log = "/dev/null";
+	Config.log_level = llError;
+	
+	Worker worker;
+	if (!worker.Start())
+	{
+		fprintf(stderr, "couldn't start worker\n");
+		return 1;
+	}
+	MeasureRecords(file);
+	printf("interval policy syncs every %d s or %d songs, songs come every %d ms\n",
+	       Config.cache_sync_interval, Config.cache_sync_records, gap);
+	Measure("none", spNone, file, songs, gap, worker);
+	Measure("interval", spInterval, file, songs, gap, worker);
+	Measure("always", spAlways, file, songs, gap, worker);
+	unlink(file.c_str());
+	return 0;
+}
@@ -0,0 +1,188 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+namespace
+{
+	void SetNonBlocking(int fd)
+	{
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+	
+	void Drain(int fd)
+	{
+		char buf[64];
+		while (read(fd, buf, sizeof(buf)) > 0) { }
+	}
+}
+
+Worker::Worker() : isRunning(0),
+		   isStopping(0),
+		   itsPosted(0),
+		   itsDone(0),
+		   itsFinished(0),
+		   itsReactor(0)
+{
+	itsWakeFD[0] = itsWakeFD[1] = -1;
+	itsDoneFD[0] = itsDoneFD[1] = -1;
+}
+
+Worker::~Worker()
+{
+#	ifdef HAVE_PTHREAD_H
+	if (isRunning)
+	{
+		__atomic_store_n(&isStopping, true, __ATOMIC_RELEASE);
+		if (write(itsWakeFD[1], "", 1) < 0) { }
+		pthread_join(itsThread, 0);
+		Finish();
+	}
+#	endif // HAVE_PTHREAD_H
+	for (int i = 0; i < 2; i++)
+	{
+		if (itsWakeFD[i] >= 0)
+			close(itsWakeFD[i]);
+		if (itsDoneFD[i] >= 0)
+			close(itsDoneFD[i]);
+	}
+}
+
+bool Worker::Start()
+{
+#	ifdef HAVE_PTHREAD_H
+	if (isRunning)
+		return true;
+	if (pipe(itsWakeFD) != 0 || pipe(itsDoneFD) != 0)
+		return false;
+	SetNonBlocking(itsWakeFD[1]);
+	SetNonBlocking(itsDoneFD[0]);
+	SetNonBlocking(itsDoneFD[1]);
+	
+	// signals are handled by main thread only
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	isRunning = pthread_create(&itsThread, 0, Main, this) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, 0);
+	return isRunning;
+#	else
+	return false;
+#	endif // HAVE_PTHREAD_H
+}
+
+void Worker::Attach(Reactor *reactor)
+{
+	itsReactor = reactor;
+	if (isRunning)
+		itsReactor->Add(itsDoneFD[0], ioRead, Ready, this);
+}
+
+void Worker::Post(Job job, Completion done, void *data)
+{
+	if (!isRunning)
+	{
+		job(data);
+		if (done)
+			done(data);
+		return;
+	}
+	// ring is full only if disk is stuck, then there's nothing better
+	// to do than to wait for it
+	if (itsPosted - itsFinished == itsCapacity)
+		Wait();
+	Slot &s = itsSlots[itsPosted % itsCapacity];
+	s.Run = job;
+	s.Done = done;
+	s.Userdata = data;
+	__atomic_store_n(&itsPosted, itsPosted+1, __ATOMIC_RELEASE);
+	if (write(itsWakeFD[1], "", 1) < 0) { }
+}
+
+void Worker::Wait()
+{
+	while (itsFinished != itsPosted)
+	{
+		if (__atomic_load_n(&itsDone, __ATOMIC_ACQUIRE) == itsFinished)
+		{
+			pollfd p;
+			p.fd = itsDoneFD[0];
+			p.events = POLLIN;
+			poll(&p, 1, -1);
+		}
+		Drain(itsDoneFD[0]);
+		Finish();
+	}
+}
+
+bool Worker::IsIdle() const
+{
+	return itsFinished == itsPosted;
+}
+
+void Worker::Finish()
+{
+	unsigned done = __atomic_load_n(&itsDone, __ATOMIC_ACQUIRE);
+	while (itsFinished != done)
+	{
+		// completion may post new jobs, so slot is released first
+		Slot s = itsSlots[itsFinished % itsCapacity];
+		itsFinished++;
+		if (s.Done)
+			s.Done(s.Userdata);
+	}
+}
+
+void Worker::Ready(int, int, void *data)
+{
+	Worker *w = static_cast<Worker *>(data);
+	Drain(w->itsDoneFD[0]);
+	w->Finish();
+}
+
+#ifdef HAVE_PTHREAD_H
+void *Worker::Main(void *data)
+{
+	Worker *w = static_cast<Worker *>(data);
+	unsigned done = 0;
+	while (true)
+	{
+		while (done != __atomic_load_n(&w->itsPosted, __ATOMIC_ACQUIRE))
+		{
+			Slot &s = w->itsSlots[done % itsCapacity];
+			s.Run(s.Userdata);
+			__atomic_store_n(&w->itsDone, ++done, __ATOMIC_RELEASE);
+			if (write(w->itsDoneFD[1], "", 1) < 0) { }
+		}
+		if (__atomic_load_n(&w->isStopping, __ATOMIC_ACQUIRE))
+			break;
+		char buf[64];
+		if (read(w->itsWakeFD[0], buf, sizeof(buf)) < 0 && errno != EINTR)
+			break;
+	}
+	return 0;
+}
+#endif // HAVE_PTHREAD_H
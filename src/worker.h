@@ -0,0 +1,96 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#include "reactor.h"
+
+/// runs jobs that would block the main loop (syncing files to disk) in
+/// a thread of their own. jobs are handed over through single-producer,
+/// single-consumer ring and run in order they were posted, completion
+/// of each one is then called from the main loop. without threads jobs
+/// run right away in Post().
+class Worker
+{
+	typedef void (*Job) (void *);
+	typedef void (*Completion) (void *);
+	
+	public:
+		Worker();
+		~Worker();
+		
+		bool Start();
+		void Attach(Reactor *);
+		
+		/// job runs in worker thread, completion in the thread that posted it
+		void Post(Job, Completion, void *);
+		
+		/// waits until all posted jobs are done and calls their completions
+		void Wait();
+		
+		bool IsIdle() const;
+		
+	private:
+		struct Slot
+		{
+			Job Run;
+			Completion Done;
+			void *Userdata;
+		};
+		
+		static const unsigned itsCapacity = 64;
+		
+		void Finish();
+		static void Ready(int, int, void *);
+		
+#		ifdef HAVE_PTHREAD_H
+		static void *Main(void *);
+		
+		pthread_t itsThread;
+#		endif // HAVE_PTHREAD_H
+		bool isRunning;
+		bool isStopping;
+		
+		// wakes up worker after jobs were posted
+		int itsWakeFD[2];
+		// wakes up main loop after jobs were done
+		int itsDoneFD[2];
+		
+		Slot itsSlots[itsCapacity];
+		// slots are used in turn: [finished, done) wait for completion,
+		// [done, posted) wait for worker. posted and finished are written
+		// by main loop only, done by worker only.
+		unsigned itsPosted;
+		unsigned itsDone;
+		unsigned itsFinished;
+		
+		Reactor *itsReactor;
+};
+
+#endif
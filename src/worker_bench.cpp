@@ -0,0 +1,102 @@
+/***************************************************************************
+ *   Copyright (C) 2008-2009 by Andrzej Rybczak                            *
+ *   electricityispower@gmail.com                                          *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+// measures how long main loop is held by journaling a song when the disk
+// is slow, with syncs done right away and with syncs done by worker.
+// usage: worker_bench [songs] [sync delay in ms]
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "misc.h"
+#include "reactor.h"
+#include "worker.h"
+
+using std::string;
+
+namespace
+{
+	int sync_delay = 20;
+	
+	void Measure(const char *name, const string &file, int songs, Worker *worker)
+	{
+		unlink(file.c_str());
+		Reactor loop;
+		if (worker)
+			worker->Attach(&loop);
+		
+		JournalWriter w;
+		w.SetPolicy(spAlways, 5, 50);
+		w.SetWorker(worker);
+		w.Open(file);
+		
+		double total = 0, worst = 0;
+		for (int i = 0; i < songs; i++)
+		{
+			// main loop picks up finished syncs between songs
+			loop.Run(0);
+			double start = CurrentTime();
+			w.Append("1700000000\t200\tArtist\tTitle\tAlbum\t1\t");
+			double elapsed = CurrentTime()-start;
+			total += elapsed;
+			if (elapsed > worst)
+				worst = elapsed;
+		}
+		double start = CurrentTime();
+		w.Flush();
+		double flush = CurrentTime()-start;
+		w.Close();
+		printf("%-7s %d songs: avg %.3f ms, max %.3f ms per song, final flush %.1f ms\n",
+		       name, songs, total*1000/songs, worst*1000, flush*1000);
+	}
+}
+
+// every sync takes as long as given on command line
+extern "C" int fdatasync(int fd)
+{
+	usleep(sync_delay*1000);
+	return syscall(SYS_fdatasync, fd);
+}
+
+int main(int argc, char **argv)
+{
+	int songs = argc > 1 ? atoi(argv[1]) : 200;
+	if (argc > 2)
+		sync_delay = atoi(argv[2]);
+	string file = "worker_bench.cache";
+	Config.file_log = "/dev/null";
+	Config.log_level = llError;
+	
+	printf("sync takes %d ms\n", sync_delay);
+	Measure("inline", file, songs, 0);
+	Worker worker;
+	if (!worker.Start())
+	{
+		fprintf(stderr, "couldn't start worker\n");
+		return 1;
+	}
+	Measure("worker", file, songs, &worker);
+	unlink(file.c_str());
+	return 0;
+}